@@ -29,14 +29,41 @@
 #include "gem.h"
 #include "objects.h"
 #include "engines/nvdec.h"
+#include "engines/vic.h"
 
 class Context : public Object
 {
 public:
+        Context() : keyframes_only(false), intra_picture(true), video_proc(false), vpp_slots(0) {
+        }
+
         NvdecOp op;
         std::unique_ptr<GemBuffer> slice_data;
         std::unique_ptr<GemBuffer> slice_data_offsets;
         uint32_t num_slices, total_slice_size;
+        VASurfaceID render_target;
+
+        /*
+         * Keyframe-only contexts drop pictures using inter prediction before
+         * they are submitted, leaving their render targets untouched.
+         */
+        bool keyframes_only;
+        bool intra_picture;
+
+        // Decode processing, scaling the decoded picture into more surfaces
+        VicOp dec_proc_op;
+        std::vector<VASurfaceID> dec_proc_outputs;
+
+        /*
+         * Video processing contexts drive VIC instead of NVDEC. Each pipeline
+         * buffer of a picture takes the next VIC slot, composited into one output.
+         */
+        bool video_proc;
+        VicOp vpp_op;
+        unsigned int vpp_slots;
+        std::array<std::unique_ptr<VicHistory>, VicOp::MAX_SLOTS> vpp_history;
+        // Surfaces receiving the same picture rescaled, in the same VIC submission
+        std::vector<VASurfaceID> vpp_additional_outputs;
 };
 
 #endif
\ No newline at end of file
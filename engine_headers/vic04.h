@@ -40,20 +40,29 @@
 								0x00001204
 #define NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_V_OFFSET \
 								0x00001208
+
+/* Surface n of slot m, each slot has 8 surfaces of luma/chroma U/chroma V offsets */
+#define VIC_SLOT_METHOD_STRIDE					0x60
+#define VIC_SURFACE_METHOD_STRIDE				0x0c
+#define VIC_SLOT_SURFACE_METHOD(slot0_method, slot, surface) \
+	((slot0_method) + (slot) * VIC_SLOT_METHOD_STRIDE + (surface) * VIC_SURFACE_METHOD_STRIDE)
 #define NVB0B6_VIDEO_COMPOSITOR_SET_CONTROL_PARAMS		0x00000704
 #define NVB0B6_VIDEO_COMPOSITOR_SET_CONFIG_STRUCT_OFFSET	0x00000708
 #define NVB0B6_VIDEO_COMPOSITOR_SET_FILTER_STRUCT_OFFSET	0x0000070C
 #define NVB0B6_VIDEO_COMPOSITOR_SET_HIST_OFFSET			0x00000714
 #define NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_LUMA_OFFSET	0x00000720
 #define NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_U_OFFSET	0x00000724
-#define NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_V_OFFSET	0x00000724
+#define NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_V_OFFSET	0x00000728
 
 #define VIC_BLK_KIND_PITCH					0
 #define VIC_BLK_KIND_GENERIC_16Bx2				1
 
 #define VIC_PIXEL_FORMAT_L8					1
 #define VIC_PIXEL_FORMAT_R8					4
+#define VIC_PIXEL_FORMAT_R5G6B5					10
 #define VIC_PIXEL_FORMAT_A8R8G8B8				32
+#define VIC_PIXEL_FORMAT_X8B8G8R8				35
+#define VIC_PIXEL_FORMAT_Y8_U8_V8_N420				66
 #define VIC_PIXEL_FORMAT_Y8_U8V8_N420				67
 #define VIC_PIXEL_FORMAT_Y8_V8U8_N420				68
 
@@ -61,6 +70,55 @@
 #define VIC_CACHE_WIDTH_64Bx4					2
 #define VIC_CACHE_WIDTH_128Bx2					3
 
+#define VIC_FRAME_FORMAT_PROGRESSIVE				0
+#define VIC_FRAME_FORMAT_INTERLACED_TOP_FIELD_FIRST		1
+#define VIC_FRAME_FORMAT_INTERLACED_BOTTOM_FIELD_FIRST		2
+#define VIC_FRAME_FORMAT_TOP_FIELD				3
+#define VIC_FRAME_FORMAT_BOTTOM_FIELD				4
+
+#define VIC_DEINTERLACE_MODE_WEAVE				0
+#define VIC_DEINTERLACE_MODE_BOB_FIELD				1
+#define VIC_DEINTERLACE_MODE_BOB				2
+#define VIC_DEINTERLACE_MODE_NEWBOB				3
+#define VIC_DEINTERLACE_MODE_DISI1				4
+
+#define VIC_BLEND_SRCFACTC_K1					0
+#define VIC_BLEND_SRCFACTC_K1_TIMES_DST				1
+#define VIC_BLEND_SRCFACTC_NEG_K1_TIMES_DST			2
+#define VIC_BLEND_SRCFACTC_K1_TIMES_SRC				3
+#define VIC_BLEND_SRCFACTC_ZERO					4
+
+#define VIC_BLEND_DSTFACTC_K1					0
+#define VIC_BLEND_DSTFACTC_K2					1
+#define VIC_BLEND_DSTFACTC_K1_TIMES_DST				2
+#define VIC_BLEND_DSTFACTC_NEG_K1_TIMES_DST			3
+#define VIC_BLEND_DSTFACTC_NEG_K1_TIMES_SRC			4
+#define VIC_BLEND_DSTFACTC_ZERO					5
+#define VIC_BLEND_DSTFACTC_ONE					6
+
+#define VIC_BLEND_SRCFACTA_K1					0
+#define VIC_BLEND_SRCFACTA_K2					1
+#define VIC_BLEND_SRCFACTA_NEG_K1_TIMES_DST			2
+#define VIC_BLEND_SRCFACTA_ZERO					3
+
+#define VIC_BLEND_DSTFACTA_K2					0
+#define VIC_BLEND_DSTFACTA_NEG_K1_TIMES_SRC			1
+#define VIC_BLEND_DSTFACTA_ZERO					2
+#define VIC_BLEND_DSTFACTA_ONE					3
+
+#define VIC_FILTER_LENGTH_1TAP					0
+#define VIC_FILTER_LENGTH_2TAP					1
+#define VIC_FILTER_LENGTH_5TAP					2
+#define VIC_FILTER_LENGTH_10TAP					3
+
+#define VIC_FILTER_PHASES					32
+#define VIC_FILTER_MAX_TAPS					10
+#define VIC_FILTER_COEFF_ONE					256
+#define VIC_FILTER_COEFFS_PER_ENTRY				12
+#define VIC_FILTER_COEFF_ENTRIES \
+	((2 * VIC_FILTER_PHASES * VIC_FILTER_MAX_TAPS + VIC_FILTER_COEFFS_PER_ENTRY - 1) / \
+	 VIC_FILTER_COEFFS_PER_ENTRY)
+
 #define __int64 long long
 
 typedef struct _SlotConfig {
@@ -329,4 +387,19 @@ typedef struct _ConfigStruct_VIC41 {
     SlotStruct                           slotStruct[16];
 } ConfigStruct_VIC41;
 
+/*
+ * Polyphase scaling filter, pointed to by SET_FILTER_STRUCT_OFFSET.
+ * Coefficients are signed 10-bit values, VIC_FILTER_COEFF_ONE being 1.0,
+ * packed three to a 32-bit word in bits 29..0. Horizontal phases come
+ * first, followed by vertical phases; each phase takes VIC_FILTER_MAX_TAPS
+ * coefficients regardless of the programmed FilterLengthX/Y.
+ */
+typedef struct _FilterCoeffStruct {
+    uint32_t coeffs[4];
+} FilterCoeffStruct;
+
+typedef struct _FilterStruct {
+    FilterCoeffStruct                    filterCoeffStruct[VIC_FILTER_COEFF_ENTRIES];
+} FilterStruct;
+
 #endif
@@ -26,7 +26,6 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
-#include <vector>
 
 #include "../engine_headers/host1x.h"
 #include "../engine_headers/nvdec.h"
@@ -60,10 +59,26 @@ static const uint8_t quant_mat_8x8nonintra[64] = {
 };
 
 NvdecOp::NvdecOp()
-    : _slice_data(nullptr)
+    : _slice_data(nullptr), _keyframes_only(false)
 {
+    _setup.valid = false;
 }
 
+/* FNV-1a, used to detect changes in parameter buffers */
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static const uint32_t HASH_INIT = 2166136261;
+
 NvdecDevice::NvdecDevice(DrmDevice& dev)
     : _dev(dev)
     , _context(0)
@@ -74,7 +89,10 @@ NvdecDevice::NvdecDevice(DrmDevice& dev)
     , _history_bo(dev)
     , _mbhist_bo(dev)
     , _coloc_bo(dev)
+    , _uploaded(nullptr)
 {
+    for (auto &t : _templates)
+        t.valid = false;
 }
 
 NvdecDevice::~NvdecDevice()
@@ -156,20 +174,57 @@ int NvdecDevice::open()
     return 0;
 }
 
-static void runMPEG2(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surfaces)
+static void runMPEG2(void *cfg, NvdecOp &op, NvdecDevice::SurfaceList &surfaces)
 {
-    nvdec_mpeg2_pic_s* c = (nvdec_mpeg2_pic_s*)cfg;
+    NvdecOp::PictureSetup &setup = op.pictureSetup();
+    nvdec_mpeg2_pic_s* c = &setup.mpeg2;
 
-    memset(c, 0, sizeof(*c));
+    const VAPictureParameterBufferMPEG2 &pp = op.mpeg2().picture_parameters;
+    const VAIQMatrixBufferMPEG2 &iq = op.mpeg2().iq_matrix;
+
+    uint32_t sequence_hash = HASH_INIT;
+    sequence_hash = hashBytes(sequence_hash, &pp.horizontal_size, sizeof(pp.horizontal_size));
+    sequence_hash = hashBytes(sequence_hash, &pp.vertical_size, sizeof(pp.vertical_size));
+    sequence_hash = hashBytes(sequence_hash, &iq, sizeof(iq));
+
+    if (!setup.valid || setup.sequence_hash != sequence_hash) {
+        memset(c, 0, sizeof(*c));
+
+        /* 16Bx2 block linear with two GOBs per block, DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB */
+        c->tileFormat = 0;
+        c->gob_height = 0;
+
+        c->FrameWidth = pp.horizontal_size;
+        c->FrameHeight = pp.vertical_size;
+        c->PicWidthInMbs = __ALIGN_KERNEL(pp.horizontal_size, 16) >> 4;
+        c->FrameHeightInMbs = __ALIGN_KERNEL(pp.vertical_size, 16) >> 4;
+
+        c->luma_top_offset = 0;
+        c->chroma_top_offset = 0;
+        c->luma_frame_offset = 0;
+        c->chroma_frame_offset = 0;
+        c->luma_bot_offset = 0;
+        c->chroma_bot_offset = 0;
+        c->output_memory_layout = 0;
+        c->ref_memory_layout[0] = 0;
+        c->ref_memory_layout[1] = 0;
+
+        if (iq.load_intra_quantiser_matrix)
+            memcpy(c->quant_mat_8x8intra, iq.intra_quantiser_matrix, 64);
+        else
+            memcpy(c->quant_mat_8x8intra, quant_mat_8x8intra, sizeof(c->quant_mat_8x8intra));
+        if (iq.load_non_intra_quantiser_matrix)
+            memcpy(c->quant_mat_8x8nonintra, iq.non_intra_quantiser_matrix, 64);
+        else
+            memcpy(c->quant_mat_8x8nonintra, quant_mat_8x8nonintra, sizeof(c->quant_mat_8x8nonintra));
+
+        setup.sequence_hash = sequence_hash;
+        setup.valid = true;
+    }
 
     c->stream_len = op.sliceDataLength();
     c->slice_count = op.numSlices();
-    c->gob_height = 0;
-
-    const VAPictureParameterBufferMPEG2 &pp = op.mpeg2().picture_parameters;
 
-    c->FrameWidth = pp.horizontal_size;
-    c->FrameHeight = pp.vertical_size;
     c->picture_structure = pp.picture_coding_extension.bits.picture_structure;
     c->picture_coding_type = pp.picture_coding_type;
     c->intra_dc_precision = pp.picture_coding_extension.bits.intra_dc_precision;
@@ -181,19 +236,8 @@ static void runMPEG2(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surfaces)
     c->f_code[2] = (pp.f_code >> 4) & 0xf; // 1,0
     c->f_code[3] = (pp.f_code >> 0) & 0xf; // 1,1
 
-    c->PicWidthInMbs = __ALIGN_KERNEL(pp.horizontal_size, 16) >> 4;
-    c->FrameHeightInMbs = __ALIGN_KERNEL(pp.vertical_size, 16) >> 4;
     c->pitch_luma = op.output().pitch;      // In bytes
     c->pitch_chroma = op.output().pitch;    // In bytes
-    c->luma_top_offset = 0;
-    c->chroma_top_offset = 0;
-    c->luma_frame_offset = 0;
-    c->chroma_frame_offset = 0;
-    c->luma_bot_offset = 0;
-    c->chroma_bot_offset = 0;
-    c->output_memory_layout = 0;
-    c->ref_memory_layout[0] = 0;
-    c->ref_memory_layout[1] = 0;
 
     c->alternate_scan = pp.picture_coding_extension.bits.alternate_scan;
     c->secondfield = pp.picture_coding_extension.bits.picture_structure != 3 &&
@@ -201,30 +245,24 @@ static void runMPEG2(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surfaces)
     c->q_scale_type = pp.picture_coding_extension.bits.q_scale_type;
     c->top_field_first = pp.picture_coding_extension.bits.top_field_first;
 
-    if (op.mpeg2().iq_matrix.load_intra_quantiser_matrix)
-        memcpy(c->quant_mat_8x8intra, op.mpeg2().iq_matrix.intra_quantiser_matrix, 64);
-    else
-        memcpy(c->quant_mat_8x8intra, quant_mat_8x8intra, sizeof(c->quant_mat_8x8intra));
-    if (op.mpeg2().iq_matrix.load_non_intra_quantiser_matrix)
-        memcpy(c->quant_mat_8x8nonintra, op.mpeg2().iq_matrix.non_intra_quantiser_matrix, 64);
-    else
-        memcpy(c->quant_mat_8x8nonintra, quant_mat_8x8nonintra, sizeof(c->quant_mat_8x8nonintra));
+    /* Single streaming write into the write-combined setup buffer */
+    memcpy(cfg, c, sizeof(*c));
 
-    surfaces.push_back(op.output().bo);
+    surfaces[0] = op.output().bo;
 
     if (op.mpeg2().forward_reference)
-        surfaces.push_back(op.mpeg2().forward_reference);
+        surfaces[1] = op.mpeg2().forward_reference;
     else if (op.mpeg2().backward_reference)
-        surfaces.push_back(op.mpeg2().backward_reference);
+        surfaces[1] = op.mpeg2().backward_reference;
     else
-        surfaces.push_back(op.output().bo);
+        surfaces[1] = op.output().bo;
 
     if (op.mpeg2().backward_reference)
-        surfaces.push_back(op.mpeg2().backward_reference);
+        surfaces[2] = op.mpeg2().backward_reference;
     else if (op.mpeg2().forward_reference && false)
-        surfaces.push_back(op.mpeg2().forward_reference);
+        surfaces[2] = op.mpeg2().forward_reference;
     else
-        surfaces.push_back(op.output().bo);
+        surfaces[2] = op.output().bo;
 }
 
 NvdecDevice::SlotManager::SlotManager() {
@@ -280,75 +318,116 @@ int NvdecDevice::SlotManager::get(VASurfaceID surface, bool insert) {
     }
 }
 
-void NvdecDevice::runH264(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surfaces)
+void NvdecDevice::runH264(void *cfg, NvdecOp &op, SurfaceList &surfaces)
 {
     const VAPictureParameterBufferH264 &pp = op.h264().picture_parameters;
-    nvdec_h264_pic_s* c = (nvdec_h264_pic_s*)cfg;
+    const VAIQMatrixBufferH264 &iq = op.h264().iq_matrix;
+    NvdecOp::PictureSetup &setup = op.pictureSetup();
+    nvdec_h264_pic_s* c = &setup.h264;
     uint32_t slot;
 
     //_slots.clean(pp.ReferenceFrames, pp.num_ref_frames);
     slot = _slots.get(pp.CurrPic.picture_id, true);
 
-    memset(c, 0, sizeof(*c));
+    uint32_t sequence_hash = HASH_INIT;
+    sequence_hash = hashBytes(sequence_hash, &pp.picture_width_in_mbs_minus1,
+                              sizeof(pp.picture_width_in_mbs_minus1));
+    sequence_hash = hashBytes(sequence_hash, &pp.picture_height_in_mbs_minus1,
+                              sizeof(pp.picture_height_in_mbs_minus1));
+    sequence_hash = hashBytes(sequence_hash, &pp.seq_fields, sizeof(pp.seq_fields));
+
+    /* field_pic_flag and reference_pic_flag change per picture, the rest come from the PPS */
+    auto pic_fields = pp.pic_fields;
+    pic_fields.bits.field_pic_flag = 0;
+    pic_fields.bits.reference_pic_flag = 0;
+
+    uint32_t picture_hash = HASH_INIT;
+    picture_hash = hashBytes(picture_hash, &pic_fields, sizeof(pic_fields));
+    picture_hash = hashBytes(picture_hash, &pp.pic_init_qp_minus26, sizeof(pp.pic_init_qp_minus26));
+    picture_hash = hashBytes(picture_hash, &pp.chroma_qp_index_offset,
+                             sizeof(pp.chroma_qp_index_offset));
+    picture_hash = hashBytes(picture_hash, &pp.second_chroma_qp_index_offset,
+                             sizeof(pp.second_chroma_qp_index_offset));
+    picture_hash = hashBytes(picture_hash, &iq, sizeof(iq));
+
+    if (!setup.valid || setup.sequence_hash != sequence_hash) {
+        memset(c, 0, sizeof(*c));
+
+        /* Same output layout as for MPEG2 */
+        c->tileFormat = 0;
+        c->gob_height = 0;
+
+        c->PicWidthInMbs = pp.picture_width_in_mbs_minus1 + 1;
+        c->FrameHeightInMbs = pp.picture_height_in_mbs_minus1 + 1;
+        c->luma_top_offset = 0;
+        c->chroma_top_offset = 0;
+        c->luma_frame_offset = 0;
+        c->chroma_frame_offset = 0;
+        c->luma_bot_offset = 0;
+        c->chroma_bot_offset = 0;
+        c->output_memory_layout = 0;
+        c->lossless_ipred8x8_filter_enable = 1;
+
+        c->chroma_format_idc = pp.seq_fields.bits.chroma_format_idc;
+        c->log2_max_frame_num_minus4 = pp.seq_fields.bits.log2_max_frame_num_minus4;
+        c->pic_order_cnt_type = pp.seq_fields.bits.pic_order_cnt_type;
+        c->log2_max_pic_order_cnt_lsb_minus4 = pp.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4;
+        c->delta_pic_order_always_zero_flag = pp.seq_fields.bits.delta_pic_order_always_zero_flag;
+        c->frame_mbs_only_flag = pp.seq_fields.bits.frame_mbs_only_flag;
+        c->direct_8x8_inference_flag = pp.seq_fields.bits.frame_mbs_only_flag;
+        c->MbaffFrameFlag = pp.seq_fields.bits.mb_adaptive_frame_field_flag;
+
+        c->HistBufferSize = _history_bo.size() / 256;
+        c->mbhist_buffer_size = _mbhist_bo.size();
+
+        setup.sequence_hash = sequence_hash;
+        /* The memset above also cleared the picture level fields */
+        setup.picture_hash = ~picture_hash;
+        setup.valid = true;
+    }
+
+    if (setup.picture_hash != picture_hash) {
+        c->constrained_intra_pred_flag = pp.pic_fields.bits.constrained_intra_pred_flag;
+        c->chroma_qp_index_offset = pp.chroma_qp_index_offset;
+        c->second_chroma_qp_index_offset = pp.second_chroma_qp_index_offset;
+
+        //c->qpprime_y_zero_transform_bypass_flag = 0;
+        memcpy(c->WeightScale, iq.ScalingList4x4, sizeof(c->WeightScale));
+        memcpy(c->WeightScale8x8, iq.ScalingList8x8, sizeof(c->WeightScale8x8));
+
+        c->entropy_coding_mode_flag = pp.pic_fields.bits.entropy_coding_mode_flag;
+        c->pic_order_present_flag = pp.pic_fields.bits.pic_order_present_flag;
+        c->weighted_pred_flag = pp.pic_fields.bits.weighted_pred_flag;
+        c->weighted_bipred_idc = pp.pic_fields.bits.weighted_bipred_idc;
+        c->pic_init_qp_minus26 = pp.pic_init_qp_minus26;
+        c->deblocking_filter_control_present_flag = pp.pic_fields.bits.deblocking_filter_control_present_flag;
+        c->redundant_pic_cnt_present_flag = pp.pic_fields.bits.redundant_pic_cnt_present_flag;
+        c->transform_8x8_mode_flag = pp.pic_fields.bits.transform_8x8_mode_flag;
+
+        setup.picture_hash = picture_hash;
+    }
 
     c->stream_len = op.sliceDataLength();
     c->slice_count = op.numSlices();
-    c->gob_height = 0;
 
-    c->PicWidthInMbs = pp.picture_width_in_mbs_minus1 + 1;
-    c->FrameHeightInMbs = pp.picture_height_in_mbs_minus1 + 1;
     c->pitch_luma = op.output().pitch;      // In bytes
     c->pitch_chroma = op.output().pitch;    // In bytes
-    c->luma_top_offset = 0;
-    c->chroma_top_offset = 0;
-    c->luma_frame_offset = 0;
-    c->chroma_frame_offset = 0;
-    c->luma_bot_offset = 0;
-    c->chroma_bot_offset = 0;
-    c->output_memory_layout = 0;
-
-    c->constrained_intra_pred_flag = pp.pic_fields.bits.constrained_intra_pred_flag;
+
     c->ref_pic_flag = pp.pic_fields.bits.reference_pic_flag;
     c->CurrFieldOrderCnt[0] = pp.CurrPic.TopFieldOrderCnt;
     c->CurrFieldOrderCnt[1] = pp.CurrPic.BottomFieldOrderCnt;
-    c->chroma_qp_index_offset = pp.chroma_qp_index_offset;
-    c->second_chroma_qp_index_offset = pp.second_chroma_qp_index_offset;
     c->CurrPicIdx = slot;
     c->CurrColIdx = slot;
     c->frame_num = pp.frame_num;
-    c->lossless_ipred8x8_filter_enable = 1;
-
-    //c->qpprime_y_zero_transform_bypass_flag = 0;
-    memcpy(c->WeightScale, op.h264().iq_matrix.ScalingList4x4, sizeof(c->WeightScale));
-    memcpy(c->WeightScale8x8, op.h264().iq_matrix.ScalingList8x8, sizeof(c->WeightScale8x8));
-
-    c->chroma_format_idc = pp.seq_fields.bits.chroma_format_idc;
-    c->log2_max_frame_num_minus4 = pp.seq_fields.bits.log2_max_frame_num_minus4;
-    c->pic_order_cnt_type = pp.seq_fields.bits.pic_order_cnt_type;
-    c->log2_max_pic_order_cnt_lsb_minus4 = pp.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4;
-    c->delta_pic_order_always_zero_flag = pp.seq_fields.bits.delta_pic_order_always_zero_flag;
-    c->frame_mbs_only_flag = pp.seq_fields.bits.frame_mbs_only_flag;
-    c->direct_8x8_inference_flag = pp.seq_fields.bits.frame_mbs_only_flag;
-    c->tileFormat = 0;
-
-    c->entropy_coding_mode_flag = pp.pic_fields.bits.entropy_coding_mode_flag;
-    c->pic_order_present_flag = pp.pic_fields.bits.pic_order_present_flag;
+
     c->num_ref_idx_l0_active_minus1 = op.h264().slice_parameters.num_ref_idx_l0_active_minus1;
     c->num_ref_idx_l1_active_minus1 = op.h264().slice_parameters.num_ref_idx_l1_active_minus1;
-    c->weighted_pred_flag = pp.pic_fields.bits.weighted_pred_flag;
-    c->weighted_bipred_idc = pp.pic_fields.bits.weighted_bipred_idc;
-    c->pic_init_qp_minus26 = pp.pic_init_qp_minus26;
-    c->deblocking_filter_control_present_flag = pp.pic_fields.bits.deblocking_filter_control_present_flag;
-    c->redundant_pic_cnt_present_flag = pp.pic_fields.bits.redundant_pic_cnt_present_flag;
-    c->transform_8x8_mode_flag = pp.pic_fields.bits.transform_8x8_mode_flag;
-    c->MbaffFrameFlag = pp.seq_fields.bits.mb_adaptive_frame_field_flag;
     c->field_pic_flag = pp.pic_fields.bits.field_pic_flag;
     c->bottom_field_flag = !!(pp.CurrPic.flags & VA_PICTURE_H264_BOTTOM_FIELD);
 
-    c->HistBufferSize = _history_bo.size() / 256;
-    c->mbhist_buffer_size = _mbhist_bo.size();
+    memset(c->dpb, 0, sizeof(c->dpb));
 
-    surfaces.resize(17, op.output().bo);
+    surfaces.fill(op.output().bo);
 
     // surfaces[slot] = op.output().bo;
 
@@ -388,7 +467,8 @@ void NvdecDevice::runH264(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surf
         int ref_slot = _slots.get(ref.picture_id, false);
         // fprintf(stderr, "%d(pic=%d slot=%d f=0x%x) ", i, ref.picture_id, ref_slot, ref.flags);
         if (ref_slot == -1) {
-            printf("Reference was not decoded yet!\n");
+            if (!op.keyframesOnly())
+                printf("Reference was not decoded yet!\n");
             continue;
         }
 
@@ -400,6 +480,9 @@ void NvdecDevice::runH264(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surf
 
     // fprintf(stderr, "\n");
 
+    /* Single streaming write into the write-combined setup buffer */
+    memcpy(cfg, c, sizeof(*c));
+
     // {
     //     char tmp[100];
     //     sprintf(tmp, "vapicsetup.%d.bin", frame);
@@ -410,37 +493,35 @@ void NvdecDevice::runH264(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surf
 
 }
 
-int NvdecDevice::run(NvdecOp& op)
+static size_t templateIndex(NvdecCodec codec)
 {
-    int err, i;
-    uint32_t* cmd = (uint32_t*)_cmd_bo.map();
-    void *c = _config_bo.map();
-    std::vector<drm_tegra_reloc> relocs;
-    std::vector<drm_tegra_submit_buf> relocs_new;
-    uint32_t application_id, codec_type;
-    std::vector<GemBuffer *> surfaces;
+    return codec == NvdecCodec::H264 ? 1 : 0;
+}
 
-    if (!c || !cmd)
-        return 1;
+int NvdecDevice::buildTemplate(CommandTemplate &t, NvdecCodec codec)
+{
+    uint32_t application_id, codec_type;
+    uint32_t *cmd = t.words.data();
+    int err, i;
 
-    switch (op.codec()) {
+    switch (codec) {
     case NvdecCodec::MPEG2:
         application_id = NVC5B0_SET_APPLICATION_ID_ID_MPEG12;
         codec_type = NVC5B0_SET_CONTROL_PARAMS_CODEC_TYPE_MPEG2;
-        runMPEG2(c, op, surfaces);
+        t.num_surfaces = 3;
         break;
     case NvdecCodec::H264:
         application_id = NVC5B0_SET_APPLICATION_ID_ID_H264;
         codec_type = NVC5B0_SET_CONTROL_PARAMS_CODEC_TYPE_H264;
-        runH264(c, op, surfaces);
+        t.num_surfaces = MAX_SURFACES;
         break;
     default:
         printf("Unsupported codec\n");
         return 1;
     }
 
-    memset(cmd, 0, 0x1000);
     i = 0;
+    t.num_relocs = 0;
 
 #define M(name, value)                                                \
     do {                                                              \
@@ -448,33 +529,32 @@ int NvdecDevice::run(NvdecOp& op)
         cmd[i++] = (name) >> 2;                                       \
         cmd[i++] = (value);                                           \
     } while (0);
+/* A null BO leaves the relocation to be filled in by patchReloc() */
 #define BO(h, offs, rw)                           \
     do {                                          \
-        if (!h) { \
-            printf("Internal error: BO is null\n"); \
-            return -1; \
-        } \
-        err = (h)->channelMap(_context, (rw));    \
-        if (err) {                                \
-            perror("Surface mapping failed");     \
-            return err;                           \
+        if (t.num_relocs == MAX_RELOCS) {         \
+            printf("Internal error: too many relocations\n"); \
+            return -1;                            \
         }                                         \
                                                   \
-        drm_tegra_submit_buf __buf = { 0 };       \
-        __buf.mapping = (h)->mappingId(_context);      \
-        __buf.reloc.target_offset = (offs);       \
+        drm_tegra_submit_buf &__buf = t.bufs[t.num_relocs]; \
+        memset(&__buf, 0, sizeof(__buf));         \
         __buf.reloc.gather_offset_words = i - 1;  \
         __buf.reloc.shift = 8;                    \
-        relocs_new.push_back(__buf);              \
                                                   \
-        drm_tegra_reloc __reloc;                  \
+        drm_tegra_reloc &__reloc = t.relocs[t.num_relocs]; \
+        memset(&__reloc, 0, sizeof(__reloc));     \
         __reloc.cmdbuf.handle = _cmd_bo.handle(); \
         __reloc.cmdbuf.offset = (i - 1) * 4;      \
-        __reloc.target.handle = (h)->handle();    \
-        __reloc.target.offset = (offs);           \
         __reloc.shift = 8;                        \
-        __reloc.pad = 0;                          \
-        relocs.push_back(__reloc);                \
+                                                  \
+        if (h) {                                  \
+            err = patchReloc(t, t.num_relocs, (h), (offs), (rw)); \
+            if (err)                              \
+                return err;                       \
+        }                                         \
+                                                  \
+        t.num_relocs++;                           \
     } while (0);
 
     M(NVC5B0_SET_APPLICATION_ID, application_id);
@@ -482,22 +562,8 @@ int NvdecDevice::run(NvdecOp& op)
         codec_type | NVC5B0_SET_CONTROL_PARAMS_GPTIMER_ON | NVC5B0_SET_CONTROL_PARAMS_ERR_CONCEAL_ON | NVC5B0_SET_CONTROL_PARAMS_ERROR_FRM_IDX(0));
     M(NVC5B0_SET_DRV_PIC_SETUP_OFFSET, 0xdeadbeef);
     BO(&_config_bo, 0, false);
-    M(NVC5B0_SET_IN_BUF_BASE_OFFSET, 0xdeadbeef);
-    BO(op.sliceData(), 0, false);
-    M(NVC5B0_SET_SLICE_OFFSETS_BUF_OFFSET, 0xdeadbeef);
-    BO(op.sliceDataOffsets(), 0, false);
-
-    for (size_t surf_i = 0; surf_i < surfaces.size(); surf_i++) {
-        if (!surfaces[surf_i])
-            continue;
-
-        M(NVC5B0_SET_PICTURE_LUMA_OFFSET0 + 4*surf_i, 0xdeadbeef);
-        BO(surfaces[surf_i], 0, true);
-        M(NVC5B0_SET_PICTURE_CHROMA_OFFSET0 + 4*surf_i, 0xdeadbeef);
-        BO(surfaces[surf_i], op.output().pitch * op.output().paddedHeight(), true);
-    }
 
-    if (op.codec() == NvdecCodec::H264) {
+    if (codec == NvdecCodec::H264) {
         M(NVC5B0_SET_COLOC_DATA_OFFSET, 0xdeadbeef);
         BO(&_coloc_bo, 0, true);
         M(NVC5B0_SET_HISTORY_OFFSET, 0xdeadbeef);
@@ -509,27 +575,134 @@ int NvdecDevice::run(NvdecOp& op)
     M(NVC5B0_SET_NVDEC_STATUS_OFFSET, 0xdeadbeef);
     BO(&_status_bo, 0, true);
 
-    static unsigned int pidx = 0;
-    M(NVC5B0_SET_PICTURE_INDEX, pidx++);
+    t.in_buf_reloc = t.num_relocs;
+    M(NVC5B0_SET_IN_BUF_BASE_OFFSET, 0xdeadbeef);
+    BO((GemBuffer *)nullptr, 0, false);
+    M(NVC5B0_SET_SLICE_OFFSETS_BUF_OFFSET, 0xdeadbeef);
+    BO((GemBuffer *)nullptr, 0, false);
+
+    t.surfaces_reloc = t.num_relocs;
+    for (size_t surf_i = 0; surf_i < t.num_surfaces; surf_i++) {
+        M(NVC5B0_SET_PICTURE_LUMA_OFFSET0 + 4*surf_i, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, true);
+        M(NVC5B0_SET_PICTURE_CHROMA_OFFSET0 + 4*surf_i, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, true);
+    }
+
+    M(NVC5B0_SET_PICTURE_INDEX, 0);
+    t.picture_index_word = i - 1;
 
     M(NVC5B0_EXECUTE, NVC5B0_EXECUTE_AWAKEN_ENABLE);
 
     cmd[i++] = host1x_opcode_nonincr(0, 1);
     cmd[i++] = _syncpt | (1 << (_is210 ? 8 : 10));
 
+#undef M
+#undef BO
+
+    t.num_words = i;
+    t.valid = true;
+
+    return 0;
+}
+
+int NvdecDevice::patchReloc(CommandTemplate &t, size_t idx, GemBuffer *bo, uint32_t offset,
+                            bool rw)
+{
+    int err;
+
+    if (!bo) {
+        printf("Internal error: BO is null\n");
+        return -1;
+    }
+
+    err = bo->channelMap(_context, rw);
+    if (err) {
+        perror("Surface mapping failed");
+        return err;
+    }
+
+    t.bufs[idx].mapping = bo->mappingId(_context);
+    t.bufs[idx].reloc.target_offset = offset;
+
+    t.relocs[idx].target.handle = bo->handle();
+    t.relocs[idx].target.offset = offset;
+
+    return 0;
+}
+
+int NvdecDevice::run(NvdecOp& op)
+{
+    int err;
+    uint32_t* cmd = (uint32_t*)_cmd_bo.map();
+    void *c = _config_bo.map();
+
+    if (!c || !cmd)
+        return 1;
+
+    _surfaces.fill(nullptr);
+
+    switch (op.codec()) {
+    case NvdecCodec::MPEG2:
+        runMPEG2(c, op, _surfaces);
+        break;
+    case NvdecCodec::H264:
+        runH264(c, op, _surfaces);
+        break;
+    default:
+        printf("Unsupported codec\n");
+        return 1;
+    }
+
+    CommandTemplate &t = _templates[templateIndex(op.codec())];
+    if (!t.valid) {
+        err = buildTemplate(t, op.codec());
+        if (err)
+            return err;
+    }
+
+    err = patchReloc(t, t.in_buf_reloc, op.sliceData(), 0, false);
+    if (err)
+        return err;
+
+    err = patchReloc(t, t.in_buf_reloc + 1, op.sliceDataOffsets(), 0, false);
+    if (err)
+        return err;
+
+    for (size_t surf_i = 0; surf_i < t.num_surfaces; surf_i++) {
+        size_t idx = t.surfaces_reloc + 2 * surf_i;
+        GemBuffer *bo = _surfaces[surf_i];
+
+        /* Empty or missing references point at the output to keep the relocation valid */
+        if (!bo)
+            bo = op.output().bo;
+
+        err = patchReloc(t, idx, bo, 0, true);
+        if (err)
+            return err;
+
+        err = patchReloc(t, idx + 1, bo,
+                         op.output().pitch * op.output().paddedHeight(), true);
+        if (err)
+            return err;
+    }
+
+    static unsigned int pidx = 0;
+    t.words[t.picture_index_word] = pidx++;
+
     if (_dev.isNewApi()) {
         drm_tegra_submit_cmd submit_cmds[1] = { 0 };
         submit_cmds[0].type = DRM_TEGRA_SUBMIT_CMD_GATHER_UPTR;
-        submit_cmds[0].gather_uptr.words = i;
+        submit_cmds[0].gather_uptr.words = t.num_words;
 
         drm_tegra_channel_submit submit = { 0 };
         submit.context = _context;
-        submit.num_bufs = relocs_new.size();
+        submit.num_bufs = t.num_relocs;
         submit.num_cmds = 1;
-        submit.gather_data_words = i;
-        submit.bufs_ptr = (__u64)&relocs_new[0];
+        submit.gather_data_words = t.num_words;
+        submit.bufs_ptr = (__u64)t.bufs.data();
         submit.cmds_ptr = (__u64)&submit_cmds[0];
-        submit.gather_data_ptr = (__u64)&cmd[0];
+        submit.gather_data_ptr = (__u64)t.words.data();
         submit.syncpt.id = _syncpt;
         submit.syncpt.increments = 1;
 
@@ -543,6 +716,14 @@ int NvdecDevice::run(NvdecOp& op)
         if (err)
             return err;
     } else {
+        /* The old UAPI gathers from _cmd_bo, which is shared by all templates */
+        if (_uploaded != &t) {
+            memcpy(cmd, t.words.data(), t.num_words * 4);
+            _uploaded = &t;
+        } else {
+            cmd[t.picture_index_word] = t.words[t.picture_index_word];
+        }
+
         drm_tegra_syncpt incr;
         incr.id = _syncpt;
         incr.incrs = 1;
@@ -550,17 +731,17 @@ int NvdecDevice::run(NvdecOp& op)
         drm_tegra_cmdbuf cmdbuf;
         cmdbuf.handle = _cmd_bo.handle();
         cmdbuf.offset = 0;
-        cmdbuf.words = i;
+        cmdbuf.words = t.num_words;
 
         drm_tegra_submit submit;
         memset(&submit, 0, sizeof(submit));
         submit.context = _context;
         submit.num_syncpts = 1;
         submit.num_cmdbufs = 1;
-        submit.num_relocs = relocs.size();
+        submit.num_relocs = t.num_relocs;
         submit.syncpts = (uintptr_t)&incr;
         submit.cmdbufs = (uintptr_t)&cmdbuf;
-        submit.relocs = (uintptr_t)&relocs[0];
+        submit.relocs = (uintptr_t)t.relocs.data();
 
         err = _dev.ioctl(DRM_IOCTL_TEGRA_SUBMIT, &submit);
         if (err == -1) {
@@ -25,9 +25,13 @@
 #define NVDEC_H
 
 #include "../gem.h"
+#include "../engine_headers/nvdec.h"
+#include "../uapi_headers/tegra_drm.h"
 #include <va/va_backend.h>
 #include <linux/kernel.h>
 
+#include <array>
+
 enum class NvdecCodec {
     MPEG2,
     H264
@@ -39,6 +43,7 @@ public:
         Surface() : bo(nullptr), width(0), height(0), pitch(0)
         { }
 
+        // NV12 in the 16Bx2 block linear layout with two GOBs per block
         GemBuffer *bo;
 
         // All in pixels
@@ -63,6 +68,22 @@ public:
         GemBuffer *references[16];
     };
 
+    /*
+     * Host copy of the picture setup struct. Fields derived from sequence
+     * and picture level parameters are only recomputed when the hash of
+     * those parameters changes.
+     */
+    struct PictureSetup {
+        bool valid;
+        uint32_t sequence_hash;
+        uint32_t picture_hash;
+
+        union {
+            nvdec_mpeg2_pic_s mpeg2;
+            nvdec_h264_pic_s h264;
+        };
+    };
+
     NvdecOp();
 
     void setCodec(NvdecCodec codec) {
@@ -81,6 +102,10 @@ public:
         return _h264;
     }
 
+    PictureSetup &pictureSetup() {
+        return _setup;
+    }
+
     void setSliceData(GemBuffer *slice_data) {
         _slice_data = slice_data;
     }
@@ -112,21 +137,31 @@ public:
     void setOutput(NvdecOp::Surface surf) { _output = surf; }
     const Surface &output() const { return _output; }
 
+    // Only intra pictures are submitted, so references are expected to be missing
+    void setKeyframesOnly(bool keyframes_only) { _keyframes_only = keyframes_only; }
+    bool keyframesOnly() const { return _keyframes_only; }
+
 private:
     NvdecCodec _codec;
 
     MPEG2 _mpeg2;
     H264 _h264;
+    PictureSetup _setup;
 
     GemBuffer *_slice_data;
     uint32_t _slice_data_length;
     uint32_t _num_slices;
     GemBuffer *_slice_data_offsets;
     NvdecOp::Surface _output;
+    bool _keyframes_only;
 };
 
 class NvdecDevice {
 public:
+    // Number of picture buffers addressable by SET_PICTURE_LUMA/CHROMA_OFFSETn
+    static constexpr size_t MAX_SURFACES = 17;
+    typedef std::array<GemBuffer *, MAX_SURFACES> SurfaceList;
+
     NvdecDevice(DrmDevice &dev);
     ~NvdecDevice();
 
@@ -134,6 +169,10 @@ public:
     int run(NvdecOp &op);
 
 private:
+    // Two per picture buffer, plus setup, bitstream, slice offsets, coloc, history, mbhist, status
+    static constexpr size_t MAX_RELOCS = 2 * MAX_SURFACES + 7;
+    static constexpr size_t MAX_CMD_WORDS = 0x1000 / 4;
+
     DrmDevice &_dev;
 
     uint64_t _context;
@@ -143,14 +182,42 @@ private:
     bool _is210;
 
     struct SlotManager {
-        std::array<VASurfaceID, 17> slots;
+        std::array<VASurfaceID, MAX_SURFACES> slots;
 
         SlotManager();
         void clean(const VAPictureH264 *refs, size_t num_refs);
         int get(VASurfaceID surface, bool insert);
     } _slots;
 
-    void runH264(void *cfg, NvdecOp &op, std::vector<GemBuffer *> &surfaces);
+    /*
+     * Command stream for one codec. It is built on first use; afterwards
+     * only the per-frame relocations and the picture index are patched.
+     */
+    struct CommandTemplate {
+        bool valid;
+        size_t num_words;
+        size_t num_relocs;
+        size_t num_surfaces;
+
+        // Bitstream and slice offsets are relocations in_buf_reloc and in_buf_reloc + 1,
+        // picture buffer n luma/chroma are surfaces_reloc + 2n and surfaces_reloc + 2n + 1
+        size_t in_buf_reloc;
+        size_t surfaces_reloc;
+        size_t picture_index_word;
+
+        std::array<uint32_t, MAX_CMD_WORDS> words;
+        std::array<drm_tegra_reloc, MAX_RELOCS> relocs;
+        std::array<drm_tegra_submit_buf, MAX_RELOCS> bufs;
+    };
+    std::array<CommandTemplate, 2> _templates;
+    const CommandTemplate *_uploaded;
+
+    // Per-job storage, reused across submissions to keep run() allocation-free
+    SurfaceList _surfaces;
+
+    int buildTemplate(CommandTemplate &t, NvdecCodec codec);
+    int patchReloc(CommandTemplate &t, size_t idx, GemBuffer *bo, uint32_t offset, bool rw);
+    void runH264(void *cfg, NvdecOp &op, SurfaceList &surfaces);
 };
 
 #endif // GEM_H
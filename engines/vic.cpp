@@ -21,14 +21,16 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
-#include <vector>
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
 #include <cmath>
 #include <cerrno>
 
 #include "vic.h"
+#include "vic_sw.h"
 #include "../engine_headers/vic04.h"
 #include "../engine_headers/host1x.h"
 #include <libdrm/drm.h>
@@ -37,18 +39,62 @@
 #include <linux/kernel.h>
 
 /*
- * Rec.601 YCbCr to RGB transform matrix. First three columns specify standard
- * rotation/scaling of the YCbCr colorspace to RGB. The last column contains
- * translation of each of the planes, respectively, due to the ranges
- * of YCbCr and RGB being different.
+ * YCbCr <-> RGB transform matrices, derived from the Kr/Kb luma coefficients
+ * of each standard. First three columns specify rotation/scaling of the
+ * colorspace. The last column contains translation of each of the planes,
+ * respectively, due to the ranges of YCbCr and RGB being different.
  */
-static const float rec601_to_rgb[] = {
-    1.16438356f,  0.00000000f,  1.59602679f, -0.87420222f,
-    1.16438356f, -0.39176229f, -0.81296765f,  0.53166782f,
-    1.16438356f,  2.01723214f,  0.00000000f, -1.08563079f
+struct CscCoefficients {
+    double kr, kb;
 };
 
-static unsigned int floatToFixed(float v, unsigned int fixed_one) {
+struct CscMatrix {
+    float m[12];
+};
+
+static constexpr CscCoefficients csc_coefficients[] = {
+    { 0.299,  0.114  },     // VicColorStandard::BT601
+    { 0.2126, 0.0722 },     // VicColorStandard::BT709
+    { 0.2627, 0.0593 },     // VicColorStandard::BT2020
+};
+
+static constexpr CscMatrix yuvToRgb(CscCoefficients k, bool full_range) {
+    double kg = 1.0 - k.kr - k.kb;
+    double ys = full_range ? 1.0 : 255.0 / 219.0;
+    double cs = full_range ? 1.0 : 255.0 / 224.0;
+    double yo = full_range ? 0.0 : 16.0 / 255.0;
+    double co = 128.0 / 255.0;
+
+    double rv = 2.0 * (1.0 - k.kr) * cs;
+    double gu = -2.0 * k.kb * (1.0 - k.kb) / kg * cs;
+    double gv = -2.0 * k.kr * (1.0 - k.kr) / kg * cs;
+    double bu = 2.0 * (1.0 - k.kb) * cs;
+
+    return {{
+        (float)ys, 0.0f,      (float)rv, (float)(-ys * yo - rv * co),
+        (float)ys, (float)gu, (float)gv, (float)(-ys * yo - (gu + gv) * co),
+        (float)ys, (float)bu, 0.0f,      (float)(-ys * yo - bu * co),
+    }};
+}
+
+static constexpr CscMatrix rgbToYuv(CscCoefficients k, bool full_range) {
+    double kg = 1.0 - k.kr - k.kb;
+    double ys = full_range ? 1.0 : 219.0 / 255.0;
+    double cs = full_range ? 1.0 : 224.0 / 255.0;
+    double yo = full_range ? 0.0 : 16.0 / 255.0;
+    double co = 128.0 / 255.0;
+
+    double ub = 1.0 / (2.0 * (1.0 - k.kb));
+    double vr = 1.0 / (2.0 * (1.0 - k.kr));
+
+    return {{
+        (float)(k.kr * ys),      (float)(kg * ys),        (float)(k.kb * ys),      (float)yo,
+        (float)(-k.kr * ub * cs), (float)(-kg * ub * cs), (float)(0.5 * cs),       (float)co,
+        (float)(0.5 * cs),       (float)(-kg * vr * cs),  (float)(-k.kb * vr * cs), (float)co,
+    }};
+}
+
+static constexpr unsigned int floatToFixed(float v, unsigned int fixed_one) {
     int x = (int)(v * (float)fixed_one + 0.5f);
     if (x < -(1 << 19))
         x = -(1 << 19);
@@ -57,12 +103,14 @@ static unsigned int floatToFixed(float v, unsigned int fixed_one) {
     return x;
 }
 
-static void matrixToFixed(const float in[12], MatrixStruct *out) {
+static constexpr MatrixStruct matrixToFixed(const CscMatrix &matrix) {
     const unsigned int FIXED_ONE = 0x3ff00;
+    const float *in = matrix.m;
+    MatrixStruct out = {};
 
     float max = in[0];
     for (size_t i = 0; i < 12; ++i) {
-        float v = fabsf(in[i]);
+        float v = in[i] < 0.0f ? -in[i] : in[i];
         if (v > max)
             max = v;
     }
@@ -73,28 +121,306 @@ static void matrixToFixed(const float in[12], MatrixStruct *out) {
         max *= 2.0f;
     }
 
-    out->matrix_coeff00 = floatToFixed(in[0*4+0], 1 << (fixed_bits + 8));
-    out->matrix_coeff01 = floatToFixed(in[0*4+1], 1 << (fixed_bits + 8));
-    out->matrix_coeff02 = floatToFixed(in[0*4+2], 1 << (fixed_bits + 8));
-    out->matrix_coeff03 = floatToFixed(in[0*4+3], FIXED_ONE);
+    out.matrix_coeff00 = floatToFixed(in[0*4+0], 1 << (fixed_bits + 8));
+    out.matrix_coeff01 = floatToFixed(in[0*4+1], 1 << (fixed_bits + 8));
+    out.matrix_coeff02 = floatToFixed(in[0*4+2], 1 << (fixed_bits + 8));
+    out.matrix_coeff03 = floatToFixed(in[0*4+3], FIXED_ONE);
+
+    out.matrix_coeff10 = floatToFixed(in[1*4+0], 1 << (fixed_bits + 8));
+    out.matrix_coeff11 = floatToFixed(in[1*4+1], 1 << (fixed_bits + 8));
+    out.matrix_coeff12 = floatToFixed(in[1*4+2], 1 << (fixed_bits + 8));
+    out.matrix_coeff13 = floatToFixed(in[1*4+3], FIXED_ONE);
+
+    out.matrix_coeff20 = floatToFixed(in[2*4+0], 1 << (fixed_bits + 8));
+    out.matrix_coeff21 = floatToFixed(in[2*4+1], 1 << (fixed_bits + 8));
+    out.matrix_coeff22 = floatToFixed(in[2*4+2], 1 << (fixed_bits + 8));
+    out.matrix_coeff23 = floatToFixed(in[2*4+3], FIXED_ONE);
+
+    out.matrix_r_shift = fixed_bits;
+    out.matrix_enable = 1;
+
+    return out;
+}
+
+#define CSC_MATRICES(k) \
+    { { matrixToFixed(yuvToRgb(k, false)), matrixToFixed(rgbToYuv(k, false)) }, \
+      { matrixToFixed(yuvToRgb(k, true)),  matrixToFixed(rgbToYuv(k, true)) } }
+
+/* Indexed by VicColorStandard, VicColorRange and VicCscDirection, computed at build time */
+static constexpr MatrixStruct csc_matrices[3][2][2] = {
+    CSC_MATRICES(csc_coefficients[0]),
+    CSC_MATRICES(csc_coefficients[1]),
+    CSC_MATRICES(csc_coefficients[2]),
+};
+
+#undef CSC_MATRICES
+
+static_assert(sizeof(csc_coefficients) / sizeof(csc_coefficients[0]) ==
+              sizeof(csc_matrices) / sizeof(csc_matrices[0]),
+              "Color matrix table does not cover every color standard");
+
+static constexpr bool sameMatrix(const MatrixStruct &a, const MatrixStruct &b) {
+    return a.matrix_coeff00 == b.matrix_coeff00 && a.matrix_coeff01 == b.matrix_coeff01 &&
+           a.matrix_coeff02 == b.matrix_coeff02 && a.matrix_coeff03 == b.matrix_coeff03 &&
+           a.matrix_coeff10 == b.matrix_coeff10 && a.matrix_coeff11 == b.matrix_coeff11 &&
+           a.matrix_coeff12 == b.matrix_coeff12 && a.matrix_coeff13 == b.matrix_coeff13 &&
+           a.matrix_coeff20 == b.matrix_coeff20 && a.matrix_coeff21 == b.matrix_coeff21 &&
+           a.matrix_coeff22 == b.matrix_coeff22 && a.matrix_coeff23 == b.matrix_coeff23 &&
+           a.matrix_r_shift == b.matrix_r_shift && a.matrix_enable == b.matrix_enable;
+}
+
+/*
+ * Limited range YCbCr to RGB matrices to 8 decimals, with chroma centered
+ * at 128/255. The BT.601 one is the table the driver used to convert at
+ * runtime; the tables derived above must give the same fixed point values
+ * bit for bit.
+ */
+static constexpr CscMatrix reference_yuv_to_rgb[] = {
+    {{ 1.16438356f,  0.00000000f,  1.59602679f, -0.87420222f,
+       1.16438356f, -0.39176229f, -0.81296765f,  0.53166782f,
+       1.16438356f,  2.01723214f,  0.00000000f, -1.08563079f }},
+    {{ 1.16438356f,  0.00000000f,  1.79274107f, -0.97294508f,
+       1.16438356f, -0.21324861f, -0.53290933f,  0.30148267f,
+       1.16438356f,  2.11240179f,  0.00000000f, -1.13340222f }},
+    {{ 1.16438356f,  0.00000000f,  1.67867411f, -0.91568793f,
+       1.16438356f, -0.18732610f, -0.65042432f,  0.34745850f,
+       1.16438356f,  2.14177232f,  0.00000000f, -1.14814508f }},
+};
+
+static_assert(sameMatrix(csc_matrices[0][0][0], matrixToFixed(reference_yuv_to_rgb[0])),
+              "BT.601 matrix differs from the reference");
+static_assert(sameMatrix(csc_matrices[1][0][0], matrixToFixed(reference_yuv_to_rgb[1])),
+              "BT.709 matrix differs from the reference");
+static_assert(sameMatrix(csc_matrices[2][0][0], matrixToFixed(reference_yuv_to_rgb[2])),
+              "BT.2020 matrix differs from the reference");
+
+/* Whether applying a then b gives back the input, which also covers standards without a reference */
+static constexpr bool inverses(const CscMatrix &a, const CscMatrix &b) {
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 4; j++) {
+            double v = (j == 3) ? b.m[i*4+3] : 0.0;
+            for (size_t k = 0; k < 3; k++)
+                v += (double)b.m[i*4+k] * a.m[k*4+j];
+
+            double expected = (i == j) ? 1.0 : 0.0;
+            if (v - expected > 1e-5 || expected - v > 1e-5)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static constexpr bool roundTrips() {
+    for (const CscCoefficients &k : csc_coefficients)
+        for (bool full_range : { false, true })
+            if (!inverses(yuvToRgb(k, full_range), rgbToYuv(k, full_range)))
+                return false;
+
+    return true;
+}
+
+static_assert(roundTrips(), "RGB to YUV matrices are not the inverse of YUV to RGB ones");
+
+static const MatrixStruct &cscMatrix(VicColorStandard standard, VicColorRange range,
+                                     VicCscDirection direction) {
+    return csc_matrices[(int)standard][(int)range][(int)direction];
+}
+
+/*
+ * RGB to RGB matrices between the primaries of each standard, going through
+ * CIE XYZ with the D65 white point they all share. They are applied to
+ * non-linear RGB, which is close enough between these standards.
+ */
+struct ColorPrimaries {
+    double rx, ry, gx, gy, bx, by;
+};
+
+static constexpr ColorPrimaries color_primaries[] = {
+    { 0.630, 0.340, 0.310, 0.595, 0.155, 0.070 },   // VicColorStandard::BT601 (SMPTE 170M)
+    { 0.640, 0.330, 0.300, 0.600, 0.150, 0.060 },   // VicColorStandard::BT709
+    { 0.708, 0.292, 0.170, 0.797, 0.131, 0.046 },   // VicColorStandard::BT2020
+};
+
+struct Matrix3 {
+    double m[9];
+};
+
+static constexpr Matrix3 multiply(const Matrix3 &a, const Matrix3 &b) {
+    Matrix3 r = {};
+
+    for (size_t i = 0; i < 3; i++)
+        for (size_t j = 0; j < 3; j++)
+            for (size_t k = 0; k < 3; k++)
+                r.m[i*3+j] += a.m[i*3+k] * b.m[k*3+j];
+
+    return r;
+}
+
+static constexpr Matrix3 invert(const Matrix3 &a) {
+    const double *m = a.m;
+    double det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+                 m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                 m[2] * (m[3] * m[7] - m[4] * m[6]);
+
+    return {{
+        (m[4] * m[8] - m[5] * m[7]) / det, (m[2] * m[7] - m[1] * m[8]) / det,
+        (m[1] * m[5] - m[2] * m[4]) / det,
+        (m[5] * m[6] - m[3] * m[8]) / det, (m[0] * m[8] - m[2] * m[6]) / det,
+        (m[2] * m[3] - m[0] * m[5]) / det,
+        (m[3] * m[7] - m[4] * m[6]) / det, (m[1] * m[6] - m[0] * m[7]) / det,
+        (m[0] * m[4] - m[1] * m[3]) / det,
+    }};
+}
 
-    out->matrix_coeff10 = floatToFixed(in[1*4+0], 1 << (fixed_bits + 8));
-    out->matrix_coeff11 = floatToFixed(in[1*4+1], 1 << (fixed_bits + 8));
-    out->matrix_coeff12 = floatToFixed(in[1*4+2], 1 << (fixed_bits + 8));
-    out->matrix_coeff13 = floatToFixed(in[1*4+3], FIXED_ONE);
+static constexpr Matrix3 rgbToXyz(const ColorPrimaries &p) {
+    const double wx = 0.3127, wy = 0.3290;
 
-    out->matrix_coeff20 = floatToFixed(in[2*4+0], 1 << (fixed_bits + 8));
-    out->matrix_coeff21 = floatToFixed(in[2*4+1], 1 << (fixed_bits + 8));
-    out->matrix_coeff22 = floatToFixed(in[2*4+2], 1 << (fixed_bits + 8));
-    out->matrix_coeff23 = floatToFixed(in[2*4+3], FIXED_ONE);
+    Matrix3 xyz = {{
+        p.rx / p.ry,              p.gx / p.gy,              p.bx / p.by,
+        1.0,                      1.0,                      1.0,
+        (1.0 - p.rx - p.ry) / p.ry, (1.0 - p.gx - p.gy) / p.gy, (1.0 - p.bx - p.by) / p.by,
+    }};
 
-    out->matrix_r_shift = fixed_bits;
-    out->matrix_enable = 1;
+    /* Scale each primary so that RGB 1.0 maps to the white point */
+    Matrix3 inv = invert(xyz);
+    double white[3] = { wx / wy, 1.0, (1.0 - wx - wy) / wy };
+
+    for (size_t j = 0; j < 3; j++) {
+        double s = inv.m[j*3+0] * white[0] + inv.m[j*3+1] * white[1] + inv.m[j*3+2] * white[2];
+        for (size_t i = 0; i < 3; i++)
+            xyz.m[i*3+j] *= s;
+    }
+
+    return xyz;
+}
+
+static constexpr CscMatrix gamut(const ColorPrimaries &from, const ColorPrimaries &to) {
+    Matrix3 m = multiply(invert(rgbToXyz(to)), rgbToXyz(from));
+
+    return {{
+        (float)m.m[0], (float)m.m[1], (float)m.m[2], 0.0f,
+        (float)m.m[3], (float)m.m[4], (float)m.m[5], 0.0f,
+        (float)m.m[6], (float)m.m[7], (float)m.m[8], 0.0f,
+    }};
+}
+
+#define GAMUT_MATRICES(from) \
+    { matrixToFixed(gamut(from, color_primaries[0])), \
+      matrixToFixed(gamut(from, color_primaries[1])), \
+      matrixToFixed(gamut(from, color_primaries[2])) }
+
+/* Indexed by source and destination VicColorStandard, computed at build time */
+static constexpr MatrixStruct gamut_matrices[3][3] = {
+    GAMUT_MATRICES(color_primaries[0]),
+    GAMUT_MATRICES(color_primaries[1]),
+    GAMUT_MATRICES(color_primaries[2]),
+};
+
+#undef GAMUT_MATRICES
+
+static const MatrixStruct &gamutMatrix(VicColorStandard from, VicColorStandard to) {
+    return gamut_matrices[(int)from][(int)to];
+}
+
+void vicCscMatrix(VicColorStandard standard, VicColorRange range, VicCscDirection direction,
+                  float m[12]) {
+    CscCoefficients k = csc_coefficients[(int)standard];
+    bool full_range = range == VicColorRange::Full;
+    CscMatrix matrix = direction == VicCscDirection::YuvToRgb ? yuvToRgb(k, full_range)
+                                                              : rgbToYuv(k, full_range);
+
+    memcpy(m, matrix.m, sizeof(matrix.m));
+}
+
+void vicGamutMatrix(VicColorStandard from, VicColorStandard to, float m[12]) {
+    CscMatrix matrix = gamut(color_primaries[(int)from], color_primaries[(int)to]);
+
+    memcpy(m, matrix.m, sizeof(matrix.m));
+}
+
+/* Support radius of each filter kernel, in source pixels when not downscaling */
+static double filterSupport(VicFilter filter) {
+    switch (filter) {
+    case VicFilter::Nearest:
+        return 0.5;
+    case VicFilter::Bilinear:
+        return 1.0;
+    case VicFilter::Bicubic:
+        return 2.0;
+    case VicFilter::Lanczos:
+        return 3.0;
+    }
+
+    return 1.0;
+}
+
+static double filterKernel(VicFilter filter, double x) {
+    const double a = -0.5;
+    x = fabs(x);
+
+    switch (filter) {
+    case VicFilter::Nearest:
+        return x < 0.5 ? 1.0 : 0.0;
+    case VicFilter::Bilinear:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case VicFilter::Bicubic:
+        /* Catmull-Rom */
+        if (x < 1.0)
+            return (a + 2.0) * x * x * x - (a + 3.0) * x * x + 1.0;
+        if (x < 2.0)
+            return a * x * x * x - 5.0 * a * x * x + 8.0 * a * x - 4.0 * a;
+        return 0.0;
+    case VicFilter::Lanczos:
+        if (x < 1e-6)
+            return 1.0;
+        if (x < 3.0)
+            return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+        return 0.0;
+    }
+
+    return 0.0;
+}
+
+/* Smallest filter length supported by the hardware covering the kernel at the given scale */
+static unsigned int filterTaps(VicFilter filter, double scale) {
+    if (filter == VicFilter::Nearest)
+        return 1;
+
+    double needed = ceil(2.0 * filterSupport(filter) * scale);
+    if (needed <= 2.0)
+        return 2;
+    if (needed <= 5.0)
+        return 5;
+    return VIC_FILTER_MAX_TAPS;
+}
+
+static unsigned int filterLength(unsigned int taps) {
+    switch (taps) {
+    case 1:
+        return VIC_FILTER_LENGTH_1TAP;
+    case 2:
+        return VIC_FILTER_LENGTH_2TAP;
+    case 5:
+        return VIC_FILTER_LENGTH_5TAP;
+    default:
+        return VIC_FILTER_LENGTH_10TAP;
+    }
+}
+
+static void setFilterCoeff(FilterStruct *f, unsigned int idx, int value) {
+    FilterCoeffStruct &entry = f->filterCoeffStruct[idx / VIC_FILTER_COEFFS_PER_ENTRY];
+    unsigned int slot = idx % VIC_FILTER_COEFFS_PER_ENTRY;
+
+    entry.coeffs[slot / 3] |= (uint32_t)(value & 0x3ff) << ((slot % 3) * 10);
 }
 
 VicOp::VicOp()
-: _clear_r(0.0), _clear_g(0.0), _clear_b(0.0)
+: _clear_r(0.0), _clear_g(0.0), _clear_b(0.0), _filter(VicFilter::Bilinear), _flip_x(false), _flip_y(false), _transpose(false)
+, _histogram(nullptr)
 {
+    for (auto &strength : _denoise)
+        strength = 0.0f;
 }
 
 void VicOp::setOutput(VicOp::Surface surf) {
@@ -102,7 +428,23 @@ void VicOp::setOutput(VicOp::Surface surf) {
 }
 
 void VicOp::setSurface(unsigned int idx, VicOp::Surface surf) {
-    _inputs[idx] = surf;
+    _inputs[idx][0] = surf;
+}
+
+void VicOp::setSlotSurface(unsigned int idx, VicSlotSurface which, VicOp::Surface surf) {
+    _inputs[idx][(int)which] = surf;
+}
+
+void VicOp::setDeinterlace(unsigned int idx, VicOp::Deinterlace deinterlace) {
+    _deinterlace[idx] = deinterlace;
+}
+
+void VicOp::setDenoise(unsigned int idx, float strength) {
+    _denoise[idx] = strength;
+}
+
+void VicOp::setBlend(unsigned int idx, VicOp::Blend blend) {
+    _blend[idx] = blend;
 }
 
 void VicOp::setClear(float r, float g, float b) {
@@ -111,12 +453,322 @@ void VicOp::setClear(float r, float g, float b) {
     _clear_b = b;
 }
 
+void VicOp::setSourceRect(unsigned int idx, VicOp::Rect rect) {
+    _source_rects[idx] = rect;
+}
+
+void VicOp::setDestRect(unsigned int idx, VicOp::Rect rect) {
+    _dest_rects[idx] = rect;
+}
+
+void VicOp::setTargetRect(VicOp::Rect rect) {
+    _target_rect = rect;
+}
+
+void VicOp::setColorSpace(unsigned int idx, VicOp::ColorSpace color_space) {
+    _color_spaces[idx] = color_space;
+}
+
+void VicOp::setOutputColorSpace(VicOp::ColorSpace color_space) {
+    _output_color_space = color_space;
+}
+
+void VicOp::setFilter(VicFilter filter) {
+    _filter = filter;
+}
+
+void VicOp::setOrientation(bool flip_x, bool flip_y, bool transpose) {
+    _flip_x = flip_x;
+    _flip_y = flip_y;
+    _transpose = transpose;
+}
+
+void VicOp::setHistogram(GemBuffer *bo) {
+    _histogram = bo;
+}
+
+/*
+ * Slots are composited before the output is flipped and transposed, so
+ * destination rectangles given on the output surface are mapped back.
+ */
+VicOp::Rect VicOp::composedDestRect(unsigned int idx) const {
+    return composed(_dest_rects[idx]);
+}
+
+VicOp::Rect VicOp::composedTargetRect() const {
+    return composed(_target_rect);
+}
+
+VicOp::Rect VicOp::composed(VicOp::Rect rect) const {
+    if (rect.empty())
+        rect = VicOp::Rect(0, 0, _output.width, _output.height);
+
+    if (_flip_x)
+        rect.x = _output.width - (rect.x + rect.width);
+    if (_flip_y)
+        rect.y = _output.height - (rect.y + rect.height);
+
+    if (_transpose)
+        rect = VicOp::Rect(rect.y, rect.x, rect.height, rect.width);
+
+    return rect;
+}
+
+uint32_t VicOp::Surface::planeOffset(unsigned int plane) const {
+    uint32_t luma_size = pitch * paddedHeight();
+    uint32_t chroma_size = (pitch / 2) * (paddedHeight() / 2);
+
+    if (plane == 0)
+        return 0;
+
+    switch (fourcc) {
+    case DRM_FORMAT_NV12:
+        return luma_size;
+    case DRM_FORMAT_YUV420:
+        return plane == 1 ? luma_size : luma_size + chroma_size;
+    case DRM_FORMAT_YVU420:
+        return plane == 1 ? luma_size + chroma_size : luma_size;
+    default:
+        return 0;
+    }
+}
+
+uint32_t VicOp::Surface::size() const {
+    uint32_t luma_size = pitch * paddedHeight();
+
+    switch (fourcc) {
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        return luma_size * 3 / 2;
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XBGR8888:
+        return luma_size * 4;
+    case DRM_FORMAT_RGB565:
+        return luma_size * 2;
+    default:
+        return luma_size;
+    }
+}
+
+bool VicOp::Surface::sameLayout(const VicOp::Surface &other) const {
+    return !bo == !other.bo && sameFormat(other);
+}
+
+bool VicOp::Surface::sameFormat(const VicOp::Surface &other) const {
+    return x == other.x && y == other.y &&
+           width == other.width && height == other.height && pitch == other.pitch &&
+           fourcc == other.fourcc && format == other.format;
+}
+
+uint8_t VicOp::surfaceMask(unsigned int idx) const {
+    uint8_t mask = 0;
+
+    /* Without a current surface, the slot is disabled */
+    if (!_inputs[idx][0].bo)
+        return 0;
+
+    for (size_t i = 0; i < SLOT_SURFACES; i++)
+        if (_inputs[idx][i].bo)
+            mask |= 1u << i;
+
+    return mask;
+}
+
+bool VicOp::sameConfig(const VicOp &other) const {
+    if (!_output.sameLayout(other._output))
+        return false;
+
+    for (size_t i = 0; i < MAX_SLOTS; i++) {
+        for (size_t j = 0; j < SLOT_SURFACES; j++)
+            if (!_inputs[i][j].sameLayout(other._inputs[i][j]))
+                return false;
+        if (!(_source_rects[i] == other._source_rects[i]) ||
+            !(_dest_rects[i] == other._dest_rects[i]) ||
+            !(_deinterlace[i] == other._deinterlace[i]) ||
+            _denoise[i] != other._denoise[i] || !(_blend[i] == other._blend[i]) ||
+            !(_color_spaces[i] == other._color_spaces[i]))
+            return false;
+    }
+
+    return _target_rect == other._target_rect && _clear_r == other._clear_r &&
+           _clear_g == other._clear_g && _clear_b == other._clear_b &&
+           _output_color_space == other._output_color_space &&
+           _filter == other._filter && _flip_x == other._flip_x &&
+           _flip_y == other._flip_y && _transpose == other._transpose;
+}
+
+VicHistory::VicHistory(DrmDevice &dev)
+: _dev(dev), _motion_index(0), _motion_valid(0), _denoise_index(0), _denoise_valid(false)
+{
+}
+
+void VicHistory::reset() {
+    _motion_valid = 0;
+    _denoise_valid = false;
+}
+
+int VicHistory::allocate(const VicOp::Surface &layout) {
+    int err;
+
+    /* Motion maps are a single 8-bit plane in the layout of the current field surface */
+    for (auto &motion : _motion) {
+        motion = std::make_unique<GemBuffer>(_dev);
+        err = motion->allocate(layout.pitch * layout.paddedHeight());
+        if (err)
+            return err;
+    }
+
+    /* Noise-reduced fields are full copies of the current surface, in its format */
+    for (auto &denoise : _denoise) {
+        denoise = std::make_unique<GemBuffer>(_dev);
+        err = denoise->allocate(layout.size());
+        if (err)
+            return err;
+    }
+
+    _layout = layout;
+    _layout.bo = nullptr;
+    _motion_index = 0;
+    _denoise_index = 0;
+    reset();
+
+    return 0;
+}
+
+int VicHistory::apply(VicOp &op, unsigned int idx) {
+    const VicOp::Surface &current = op.input(idx);
+    bool motion_adaptive = op.deinterlace(idx).mode == VicDeinterlace::MotionAdaptive;
+    bool denoise = op.denoise(idx) > 0.0f;
+    int err;
+
+    if (!motion_adaptive && !denoise)
+        return 0;
+
+    /* _layout has no buffer of its own, only the format of the surfaces matters */
+    if (!_motion[0] || !_layout.sameFormat(current)) {
+        err = allocate(current);
+        if (err)
+            return err;
+    }
+
+    /*
+     * Temporal denoising compares against the previous noise-reduced frame,
+     * unless deinterlacing already claims the previous field.
+     */
+    if (denoise && !op.slotSurface(idx, VicSlotSurface::Previous).bo) {
+        VicOp::Surface nr = _layout;
+
+        nr.bo = _denoise[_denoise_index].get();
+        op.setSlotSurface(idx, VicSlotSurface::NextNoiseReduced, nr);
+
+        if (_denoise_valid) {
+            nr.bo = _denoise[(_denoise_index + 1) % DENOISE_FRAMES].get();
+            op.setSlotSurface(idx, VicSlotSurface::Previous, nr);
+        }
+
+        _denoise_index = (_denoise_index + 1) % DENOISE_FRAMES;
+        _denoise_valid = true;
+    }
+
+    if (!motion_adaptive)
+        return 0;
+
+    VicOp::Surface motion = _layout;
+    motion.fourcc = DRM_FORMAT_R8;
+
+    /* Written for the current field, read back for the next two */
+    motion.bo = _motion[_motion_index].get();
+    op.setSlotSurface(idx, VicSlotSurface::CurrentMotion, motion);
+
+    if (_motion_valid >= 1) {
+        motion.bo = _motion[(_motion_index + MOTION_FIELDS - 1) % MOTION_FIELDS].get();
+        op.setSlotSurface(idx, VicSlotSurface::PreviousMotion, motion);
+    }
+
+    if (_motion_valid >= 2) {
+        motion.bo = _motion[(_motion_index + MOTION_FIELDS - 2) % MOTION_FIELDS].get();
+        op.setSlotSurface(idx, VicSlotSurface::PpMotion, motion);
+    }
+
+    _motion_index = (_motion_index + 1) % MOTION_FIELDS;
+    _motion_valid = std::min(_motion_valid + 1, (unsigned int)MOTION_FIELDS - 1);
+
+    return 0;
+}
+
+/* VIC pixel format of a DRM fourcc, or -1 if VIC cannot read or write it */
+static int vicPixelFormat(uint32_t fourcc) {
+    switch (fourcc) {
+    case DRM_FORMAT_ARGB8888:
+        return VIC_PIXEL_FORMAT_A8R8G8B8;
+    case DRM_FORMAT_XBGR8888:
+        return VIC_PIXEL_FORMAT_X8B8G8R8;
+    case DRM_FORMAT_RGB565:
+        return VIC_PIXEL_FORMAT_R5G6B5;
+    case DRM_FORMAT_NV12:
+        return VIC_PIXEL_FORMAT_Y8_U8V8_N420;
+    /* Plane order is handled by the chroma U/V offsets */
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        return VIC_PIXEL_FORMAT_Y8_U8_V8_N420;
+    default:
+        return -1;
+    }
+}
+
+static bool isYuv(uint32_t fourcc) {
+    return fourcc == DRM_FORMAT_NV12 || fourcc == DRM_FORMAT_YUV420 ||
+           fourcc == DRM_FORMAT_YVU420;
+}
+
+/*
+ * Slots in the color space of a YUV output are composited as they are. Any
+ * other combination is composited in RGB: slots are converted to RGB and to
+ * the output primaries, and the result converted back for YUV outputs.
+ */
+static bool composesInRgb(const VicOp &op) {
+    if (!isYuv(op.output().fourcc))
+        return true;
+
+    for (unsigned int i = 0; i < VicOp::MAX_SLOTS; i++) {
+        if (!op.input(i).bo)
+            continue;
+
+        if (!isYuv(op.input(i).fourcc) || !(op.colorSpace(i) == op.outputColorSpace()))
+            return true;
+    }
+
+    return false;
+}
+
+/* RGB surfaces are taken to be sRGB */
+static VicColorStandard primaries(uint32_t fourcc, const VicOp::ColorSpace &color_space) {
+    return isYuv(fourcc) ? color_space.standard : VicColorStandard::BT709;
+}
+
+/* Slot surfaces VIC writes back for use on following frames */
+static bool slotSurfaceWritten(unsigned int surface) {
+    return surface == (unsigned int)VicSlotSurface::NextNoiseReduced ||
+           surface == (unsigned int)VicSlotSurface::CurrentMotion;
+}
+
 VicDevice::VicDevice(DrmDevice &dev)
-: _dev(dev), _context(0), _syncpt(0xffffffff), _cmd_bo(dev), _config_bo(dev), _filter_bo(dev)
+: _dev(dev), _context(0), _syncpt(0xffffffff), _pending(false), _pending_fence(0),
+  _cmd_bo(dev), _config_bo(dev), _filter_bo(dev), _config_clock(0), _filter_clock(0)
 {
+    _template.valid = false;
+
+    for (auto &entry : _config_cache)
+        entry.valid = false;
+
+    for (auto &entry : _filter_cache)
+        entry.valid = false;
 }
 
 VicDevice::~VicDevice() {
+    sync();
+
     if (_syncpt != 0xffffffff)
         _dev.free_syncpoint(_syncpt);
     if (_context)
@@ -128,13 +780,14 @@ int VicDevice::open() {
     FILE *fp;
     int err;
 
-    if (_context)
+    if (_context || _sw)
         return 0;
 
     fp = fopen("/sys/devices/soc0/soc_id", "r");
     if (!fp) {
-        perror("Failed to open /sys/devices/soc0/soc_id");
-        return -errno;
+        perror("Failed to open /sys/devices/soc0/soc_id, using software VIC");
+        _sw.reset(new VicSoftware());
+        return 0;
     }
 
     fread(tmp, 1, sizeof(tmp)-1, fp);
@@ -146,21 +799,32 @@ int VicDevice::open() {
     else if (!strcmp(tmp, "25\n"))
         _version = Version::Vic4_1;
     else {
-        printf("Unknown chip\n");
-        return -1;
+        printf("Unknown chip, using software VIC\n");
+        _sw.reset(new VicSoftware());
+        return 0;
     }
 
+    /*
+     * On a known chip a missing channel is usually a kernel or permission
+     * problem, which should not silently turn into slow output
+     */
     err = _dev.open_channel(HOST1X_CLASS_VIC, &_context);
     if (err == -1) {
-        perror("Channel open failed");
-        return err;
+        if (!getenv("TEGRA_VIC_SOFTWARE")) {
+            perror("Channel open failed, set TEGRA_VIC_SOFTWARE=1 to use software VIC");
+            return err;
+        }
+
+        perror("Channel open failed, using software VIC");
+        _sw.reset(new VicSoftware());
+        return 0;
     }
 
-    err = _cmd_bo.allocate(0x1000);
+    err = _cmd_bo.allocate(MAX_CMD_WORDS * 4);
     if (err)
         return err;
 
-    err = _config_bo.allocate(sizeof(ConfigStruct_VIC41));
+    err = _config_bo.allocate(CONFIG_CACHE_SIZE * CONFIG_STRIDE);
     if (err)
         return err;
 
@@ -168,7 +832,7 @@ int VicDevice::open() {
     if (err)
         return err;
 
-    err = _filter_bo.allocate(0x3000);
+    err = _filter_bo.allocate(FILTER_CACHE_SIZE * FILTER_STRIDE);
     if (err)
         return err;
 
@@ -185,43 +849,462 @@ int VicDevice::open() {
     return 0;
 }
 
-int VicDevice::run(VicOp &op)
+int VicDevice::buildTemplate(CommandTemplate &t, const SurfaceMasks *surface_masks,
+                             const bool *histograms, size_t count)
 {
-    int err, i;
-    ConfigStruct_VIC41 *c = (ConfigStruct_VIC41 *)_config_bo.map();
-    uint32_t *cmd = (uint32_t *)_cmd_bo.map();
-    std::vector<drm_tegra_reloc> relocs;
-    std::vector<drm_tegra_submit_buf> relocs_new;
+    uint32_t *cmd = t.words.data();
     bool is41 = _version == Version::Vic4_1;
+    uint32_t luma_method = is41 ? NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_LUMA_OFFSET
+                                : NVB0B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_LUMA_OFFSET;
+    uint32_t chroma_u_method = is41 ? NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_U_OFFSET
+                                    : NVB0B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_U_OFFSET;
+    uint32_t chroma_v_method = is41 ? NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_V_OFFSET
+                                    : NVB0B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_V_OFFSET;
+    unsigned int max_slots = maxSlots();
+    int err, i;
+
+    if (count > MAX_BATCH) {
+        printf("Internal error: too many ops in batch\n");
+        return -1;
+    }
 
-    if (!c || !cmd)
+    for (size_t pass = 0; pass < count; pass++) {
+        for (unsigned int slot = max_slots; slot < MAX_SLOTS; slot++) {
+            if (surface_masks[pass][slot]) {
+                printf("Internal error: too many slots\n");
+                return -1;
+            }
+        }
+    }
+
+    i = 0;
+    t.num_relocs = 0;
+
+#define M(name, value) do {\
+    cmd[i++] = host1x_opcode_incr(VIC_UCLASS_METHOD_OFFSET, 2);\
+    cmd[i++] = (name) >> 2;\
+    cmd[i++] = (value);\
+} while (0);
+/* A null BO leaves the relocation to be filled in by patchReloc() */
+#define BO(h, offs, rw) do {\
+    if (t.num_relocs == MAX_RELOCS) {\
+        printf("Internal error: too many relocations\n");\
+        return -1;\
+    }\
+    \
+    drm_tegra_submit_buf &__buf = t.bufs[t.num_relocs];\
+    memset(&__buf, 0, sizeof(__buf));\
+    __buf.reloc.gather_offset_words = i-1;\
+    __buf.reloc.shift = 8;\
+    \
+    drm_tegra_reloc &__reloc = t.relocs[t.num_relocs];\
+    memset(&__reloc, 0, sizeof(__reloc));\
+    __reloc.cmdbuf.handle = _cmd_bo.handle();\
+    __reloc.cmdbuf.offset = (i-1)*4;\
+    __reloc.shift = 8;\
+    \
+    if (h) {\
+        err = patchReloc(t, t.num_relocs, (h), (offs), (rw));\
+        if (err)\
+            return err;\
+    }\
+    \
+    t.num_relocs++;\
+} while(0);
+
+    /* Each op is a full method sequence of its own, incrementing the syncpoint when done */
+    for (size_t pass = 0; pass < count; pass++) {
+        PassRelocs &p = t.passes[pass];
+
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_APPLICATION_ID, 1);
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_CONTROL_PARAMS,
+            ((is41 ? sizeof(ConfigStruct_VIC41) : sizeof(ConfigStruct_VIC40)) / 16) << 16);
+        p.config_reloc = t.num_relocs;
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_CONFIG_STRUCT_OFFSET, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, false);
+        p.filter_reloc = t.num_relocs;
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_FILTER_STRUCT_OFFSET, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, false);
+
+        p.output_reloc = t.num_relocs;
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_LUMA_OFFSET, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, true);
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_U_OFFSET, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, true);
+        M(NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_V_OFFSET, 0xdeadbeef);
+        BO((GemBuffer *)nullptr, 0, true);
+
+        if (histograms[pass]) {
+            p.hist_reloc = t.num_relocs;
+            M(NVB0B6_VIDEO_COMPOSITOR_SET_HIST_OFFSET, 0xdeadbeef);
+            BO((GemBuffer *)nullptr, 0, true);
+        }
+
+        for (unsigned int slot = 0; slot < max_slots; slot++) {
+            for (unsigned int surface = 0; surface < VicOp::SLOT_SURFACES; surface++) {
+                if (!(surface_masks[pass][slot] & (1u << surface)))
+                    continue;
+
+                bool rw = slotSurfaceWritten(surface);
+
+                p.surface_relocs[slot][surface] = t.num_relocs;
+
+                M(VIC_SLOT_SURFACE_METHOD(luma_method, slot, surface), 0xdeadbeef);
+                BO((GemBuffer *)nullptr, 0, rw);
+
+                M(VIC_SLOT_SURFACE_METHOD(chroma_u_method, slot, surface), 0xdeadbeef);
+                BO((GemBuffer *)nullptr, 0, rw);
+
+                M(VIC_SLOT_SURFACE_METHOD(chroma_v_method, slot, surface), 0xdeadbeef);
+                BO((GemBuffer *)nullptr, 0, rw);
+            }
+        }
+
+        M(NVB0B6_VIDEO_COMPOSITOR_EXECUTE, (1 << 8));
+        cmd[i++] = host1x_opcode_nonincr(0, 1);
+        cmd[i++] = _syncpt | (1 << (is41 ? 10 : 8));
+    }
+
+#undef M
+#undef BO
+
+    t.num_words = i;
+    t.num_passes = count;
+    std::copy(surface_masks, surface_masks + count, t.surface_masks.begin());
+    std::copy(histograms, histograms + count, t.histograms.begin());
+    t.uploaded = false;
+    t.valid = true;
+
+    return 0;
+}
+
+int VicDevice::patchReloc(CommandTemplate &t, size_t idx, GemBuffer *bo, uint32_t offset,
+                          bool rw)
+{
+    int err;
+
+    if (!bo) {
+        printf("Internal error: BO is null\n");
+        return -1;
+    }
+
+    err = bo->channelMap(_context, rw);
+    if (err) {
+        perror("Surface mapping failed");
+        return err;
+    }
+
+    t.bufs[idx].mapping = bo->mappingId(_context);
+    t.bufs[idx].reloc.target_offset = offset;
+
+    t.relocs[idx].target.handle = bo->handle();
+    t.relocs[idx].target.offset = offset;
+
+    return 0;
+}
+
+VicDevice::FilterParams VicDevice::filterParams(const VicOp &op)
+{
+    unsigned int src_width, src_height, dst_width, dst_height;
+    unsigned int first = 0;
+    FilterParams params;
+
+    params.filter = op.filter();
+    params.ratio_x = FILTER_RATIO_STEPS;
+    params.ratio_y = FILTER_RATIO_STEPS;
+
+    /* The filter table is shared by all slots, so it is sized for the first one */
+    while (first < VicOp::MAX_SLOTS - 1 && !op.input(first).bo)
+        first++;
+
+    const VicOp::Surface &in0 = op.input(first);
+    const VicOp::Rect &src = op.sourceRect(first);
+    VicOp::Rect dst = op.composedDestRect(first);
+
+    if (in0.bo) {
+        src_width = src.empty() ? in0.width - in0.x : src.width;
+        src_height = src.empty() ? in0.height - in0.y : src.height;
+        dst_width = dst.width;
+        dst_height = dst.height;
+
+        if (dst_width && src_width > dst_width)
+            params.ratio_x = std::min((src_width * FILTER_RATIO_STEPS + dst_width / 2) / dst_width,
+                                      FILTER_MAX_RATIO);
+        if (dst_height && src_height > dst_height)
+            params.ratio_y = std::min((src_height * FILTER_RATIO_STEPS + dst_height / 2) / dst_height,
+                                      FILTER_MAX_RATIO);
+    }
+
+    params.taps_x = filterTaps(params.filter, (double)params.ratio_x / FILTER_RATIO_STEPS);
+    params.taps_y = filterTaps(params.filter, (double)params.ratio_y / FILTER_RATIO_STEPS);
+
+    return params;
+}
+
+void VicDevice::buildFilter(const FilterParams &params, FilterStruct *f)
+{
+    memset(f, 0, sizeof(*f));
+
+    for (unsigned int dir = 0; dir < 2; dir++) {
+        unsigned int taps = dir ? params.taps_y : params.taps_x;
+        double scale = (double)(dir ? params.ratio_y : params.ratio_x) / FILTER_RATIO_STEPS;
+        double support = filterSupport(params.filter);
+        unsigned int center = (taps - 1) / 2;
+
+        /* Past 10 taps the kernel cannot be widened any further, so it gets sharper */
+        scale = std::min(scale, VIC_FILTER_MAX_TAPS / (2.0 * support));
+
+        for (unsigned int phase = 0; phase < VIC_FILTER_PHASES; phase++) {
+            unsigned int base = (dir * VIC_FILTER_PHASES + phase) * VIC_FILTER_MAX_TAPS;
+            double frac = (double)phase / VIC_FILTER_PHASES;
+            double weights[VIC_FILTER_MAX_TAPS];
+            int coeffs[VIC_FILTER_MAX_TAPS];
+            double sum = 0.0;
+            unsigned int largest = 0;
+            int total = 0;
+
+            if (taps == 1) {
+                setFilterCoeff(f, base, VIC_FILTER_COEFF_ONE);
+                continue;
+            }
+
+            for (unsigned int t = 0; t < taps; t++) {
+                weights[t] = filterKernel(params.filter, ((int)t - (int)center - frac) / scale);
+                sum += weights[t];
+            }
+
+            /* Normalize so that the quantized taps add up to exactly 1.0 */
+            for (unsigned int t = 0; t < taps; t++) {
+                coeffs[t] = (int)lround(weights[t] / sum * VIC_FILTER_COEFF_ONE);
+                total += coeffs[t];
+                if (coeffs[t] > coeffs[largest])
+                    largest = t;
+            }
+            coeffs[largest] += VIC_FILTER_COEFF_ONE - total;
+
+            for (unsigned int t = 0; t < taps; t++)
+                setFilterCoeff(f, base + t, std::max(-512, std::min(coeffs[t], 511)));
+        }
+    }
+}
+
+int VicDevice::lookupFilter(const FilterParams &params, uint32_t *offset)
+{
+    FilterCacheEntry *victim = &_filter_cache[0];
+    uint8_t *map;
+
+    _filter_clock++;
+
+    for (auto &entry : _filter_cache) {
+        if (entry.valid && entry.params == params) {
+            entry.last_use = _filter_clock;
+            *offset = (&entry - &_filter_cache[0]) * FILTER_STRIDE;
+            return 0;
+        }
+
+        if (!entry.valid)
+            victim = &entry;
+        else if (victim->valid && entry.last_use < victim->last_use)
+            victim = &entry;
+    }
+
+    map = (uint8_t *)_filter_bo.map();
+    if (!map)
         return 1;
 
+    buildFilter(params, &_filter_staging);
+
+    *offset = (victim - &_filter_cache[0]) * FILTER_STRIDE;
+    memcpy(map + *offset, &_filter_staging, sizeof(_filter_staging));
+
+    victim->params = params;
+    victim->last_use = _filter_clock;
+    victim->valid = true;
+
+    return 0;
+}
+
+int VicDevice::buildSlot(const VicOp &op, unsigned int idx, SlotStruct *s)
+{
+    const VicOp::Surface &in = op.input(idx);
+
+    const VicOp::Deinterlace &deinterlace = op.deinterlace(idx);
+    uint8_t surfaces = op.surfaceMask(idx);
+
+    SlotConfig &slot = s->slotConfig;
+    slot.SlotEnable = 1;
+    slot.CurrentFieldEnable = 1;
+    slot.PrevFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::Previous));
+    slot.NextFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::Next));
+    slot.NextNrFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::NextNoiseReduced));
+    slot.CurMotionFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::CurrentMotion));
+    slot.PrevMotionFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::PreviousMotion));
+    slot.PpMotionFieldEnable = !!(surfaces & (1u << (int)VicSlotSurface::PpMotion));
+
+    switch (deinterlace.mode) {
+    case VicDeinterlace::None:
+        slot.FrameFormat = VIC_FRAME_FORMAT_PROGRESSIVE;
+        break;
+    case VicDeinterlace::Weave:
+        slot.FrameFormat = deinterlace.bottom_field_first
+                               ? VIC_FRAME_FORMAT_INTERLACED_BOTTOM_FIELD_FIRST
+                               : VIC_FRAME_FORMAT_INTERLACED_TOP_FIELD_FIRST;
+        slot.DeinterlaceMode = VIC_DEINTERLACE_MODE_WEAVE;
+        break;
+    case VicDeinterlace::Bob:
+    case VicDeinterlace::MotionAdaptive:
+        slot.FrameFormat = deinterlace.bottom_field ? VIC_FRAME_FORMAT_BOTTOM_FIELD
+                                                    : VIC_FRAME_FORMAT_TOP_FIELD;
+        slot.IsEven = !deinterlace.bottom_field;
+        slot.ChromaEven = !deinterlace.bottom_field;
+
+        /* Falls back to bob until there are neighbouring fields to compare with */
+        if (deinterlace.mode == VicDeinterlace::MotionAdaptive &&
+            slot.PrevFieldEnable && slot.NextFieldEnable && slot.CurMotionFieldEnable) {
+            slot.DeinterlaceMode = VIC_DEINTERLACE_MODE_DISI1;
+            slot.MotionMap = 1;
+            slot.MotionAccumWeight = 6;
+        } else {
+            slot.DeinterlaceMode = VIC_DEINTERLACE_MODE_BOB;
+        }
+        break;
+    }
+
+    float strength = std::min(op.denoise(idx), 1.0f);
+    if (strength > 0.0f) {
+        slot.DeNoise = 1;
+        /* Temporal filtering once there is a previous frame to compare with */
+        slot.AdvancedDenoise = slot.PrevFieldEnable;
+        slot.FilterNoise = strength * 1023;
+        slot.ChromaNoise = strength * 1023;
+        slot.NoiseIir = strength * 2047;
+    }
+
+    const VicOp::Blend &blend = op.blend(idx);
+    if (blend.enabled) {
+        /* Source over, with per-pixel alpha scaled by the global alpha K1 */
+        unsigned int alpha = std::max(0.0f, std::min(blend.global_alpha, 1.0f)) * 1023;
+
+        slot.PlanarAlpha = alpha;
+        slot.ConstantAlpha = in.fourcc != DRM_FORMAT_ARGB8888;
+
+        BlendingSlotStruct &b = s->blendingSlotStruct;
+        b.AlphaK1 = alpha;
+        b.SrcFactCMatchSelect = blend.premultiplied ? VIC_BLEND_SRCFACTC_K1
+                                                    : VIC_BLEND_SRCFACTC_K1_TIMES_SRC;
+        b.DstFactCMatchSelect = VIC_BLEND_DSTFACTC_NEG_K1_TIMES_SRC;
+        b.SrcFactAMatchSelect = VIC_BLEND_SRCFACTA_K1;
+        b.DstFactAMatchSelect = VIC_BLEND_DSTFACTA_NEG_K1_TIMES_SRC;
+    } else {
+        slot.PlanarAlpha = 1023;
+        slot.ConstantAlpha = 1;
+    }
+
+    // Source rectangle is in 16.16 fixed point
+    const VicOp::Rect &src = op.sourceRect(idx);
+    if (src.empty()) {
+        slot.SourceRectLeft = in.x << 16;
+        slot.SourceRectRight = (in.width - 1) << 16;
+        slot.SourceRectTop = in.y << 16;
+        slot.SourceRectBottom = (in.height - 1) << 16;
+    } else {
+        slot.SourceRectLeft = src.x << 16;
+        slot.SourceRectRight = (src.x + src.width - 1) << 16;
+        slot.SourceRectTop = src.y << 16;
+        slot.SourceRectBottom = (src.y + src.height - 1) << 16;
+    }
+
+    VicOp::Rect dst = op.composedDestRect(idx);
+    slot.DestRectLeft = dst.x;
+    slot.DestRectRight = dst.x + dst.width - 1;
+    slot.DestRectTop = dst.y;
+    slot.DestRectBottom = dst.y + dst.height - 1;
+
+    slot.SoftClampHigh = 1023;
+
+    FilterParams filter = filterParams(op);
+    slot.FilterLengthX = filterLength(filter.taps_x);
+    slot.FilterLengthY = filterLength(filter.taps_y);
+
+    SlotSurfaceConfig &surf = s->slotSurfaceConfig;
+    int pixel_format = vicPixelFormat(in.fourcc);
+    if (pixel_format < 0)
+        return 1;
+    surf.SlotPixelFormat = pixel_format;
+
+    if (composesInRgb(op)) {
+        const VicOp::ColorSpace &cs = op.colorSpace(idx);
+        VicColorStandard from = primaries(in.fourcc, cs);
+        VicColorStandard to = primaries(op.output().fourcc, op.outputColorSpace());
+
+        if (isYuv(in.fourcc))
+            s->colorMatrixStruct = cscMatrix(cs.standard, cs.range, VicCscDirection::YuvToRgb);
+        if (from != to)
+            s->gamutMatrixStruct = gamutMatrix(from, to);
+    }
+
+    switch (in.format) {
+    case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB:
+        surf.SlotBlkKind = VIC_BLK_KIND_GENERIC_16Bx2;
+        surf.SlotBlkHeight = 1;
+        surf.SlotCacheWidth = VIC_CACHE_WIDTH_32Bx8;
+        break;
+    case DRM_FORMAT_MOD_LINEAR:
+        surf.SlotBlkKind = VIC_BLK_KIND_PITCH;
+        surf.SlotCacheWidth = VIC_CACHE_WIDTH_64Bx4;
+        break;
+    default:
+        return 1;
+    }
+    surf.SlotSurfaceWidth = in.width - 1;          // Non-padded width in pixels
+    surf.SlotSurfaceHeight = in.height - 1;        // Height in pixels
+    surf.SlotLumaWidth = in.pitch - 1;             // Padded width in pixels
+    surf.SlotLumaHeight = in.height - 1;           // Height in pixels
+    surf.SlotChromaWidth = (in.pitch / 2) - 1;     // Padded width in pixels
+    surf.SlotChromaHeight = (in.height / 2) - 1;   // Height in pixels
+
+    surf.SlotChromaLocHoriz = 1;
+    surf.SlotChromaLocVert = 1;
+
+    return 0;
+}
+
+int VicDevice::buildConfig(const VicOp &op, ConfigStruct_VIC41 *c)
+{
     memset(c, 0, sizeof(*c));
 
-    c->outputConfig.TargetRectTop = 0;
-    c->outputConfig.TargetRectLeft = 0;
-    c->outputConfig.TargetRectRight = op.output().width-1;
-    c->outputConfig.TargetRectBottom = op.output().height-1;
+    /* The target rectangle is in composition space, before transposition */
+    VicOp::Rect target = op.composedTargetRect();
+
+    c->outputConfig.TargetRectTop = target.y;
+    c->outputConfig.TargetRectLeft = target.x;
+    c->outputConfig.TargetRectRight = target.x + target.width - 1;
+    c->outputConfig.TargetRectBottom = target.y + target.height - 1;
+    c->outputConfig.OutputFlipX = op.flipX();
+    c->outputConfig.OutputFlipY = op.flipY();
+    c->outputConfig.OutputTranspose = op.transpose();
     c->outputConfig.BackgroundAlpha = 1023;
     c->outputConfig.BackgroundR = op.clearR() * 1023;
     c->outputConfig.BackgroundG = op.clearG() * 1023;
     c->outputConfig.BackgroundB = op.clearB() * 1023;
 
-    switch (op.output().fourcc) {
-    case DRM_FORMAT_ARGB8888:
-        c->outputSurfaceConfig.OutPixelFormat = VIC_PIXEL_FORMAT_A8R8G8B8;
-        break;
-    case DRM_FORMAT_NV12:
-        c->outputSurfaceConfig.OutPixelFormat = VIC_PIXEL_FORMAT_Y8_U8V8_N420;
-        break;
-    default:
+    int pixel_format = vicPixelFormat(op.output().fourcc);
+    if (pixel_format < 0)
         return 1;
-    }
+    c->outputSurfaceConfig.OutPixelFormat = pixel_format;
+
+    const VicOp::ColorSpace &out_cs = op.outputColorSpace();
+    if (isYuv(op.output().fourcc) && composesInRgb(op))
+        c->outColorMatrixStruct =
+            cscMatrix(out_cs.standard, out_cs.range, VicCscDirection::RgbToYuv);
     switch (op.output().format) {
     case DRM_FORMAT_MOD_LINEAR:
         c->outputSurfaceConfig.OutBlkKind = VIC_BLK_KIND_PITCH;
         break;
+    case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB:
+        c->outputSurfaceConfig.OutBlkKind = VIC_BLK_KIND_GENERIC_16Bx2;
+        c->outputSurfaceConfig.OutBlkHeight = 1;
+        break;
     default:
         return 1;
     }
@@ -233,136 +1316,221 @@ int VicDevice::run(VicOp &op)
     c->outputSurfaceConfig.OutChromaWidth = (op.output().pitch / 2)-1;
     c->outputSurfaceConfig.OutChromaHeight = (op.output().height / 2)-1;
 
-    const VicOp::Surface &in0 = op.input(0);
-    if (in0.bo) {
-        SlotConfig &slot = c->slotStruct[0].slotConfig;
-        slot.SlotEnable = 1;
-        slot.CurrentFieldEnable = 1;
-        slot.PlanarAlpha = 1023;
-        slot.ConstantAlpha = 1;
-        slot.SourceRectLeft = in0.x << 16;
-        slot.SourceRectRight = (in0.width - 1) << 16;
-        slot.SourceRectTop = in0.y << 16;
-        slot.SourceRectBottom = (in0.height - 1) << 16;
-        slot.DestRectLeft = 0;
-        slot.DestRectRight = op.output().width - 1;
-        slot.DestRectTop = 0;
-        slot.DestRectBottom = op.output().height - 1;
-
-        slot.SoftClampHigh = 1023;
-
-        SlotSurfaceConfig &surf = c->slotStruct[0].slotSurfaceConfig;
-        switch (in0.fourcc) {
-        case DRM_FORMAT_ARGB8888:
-            surf.SlotPixelFormat = VIC_PIXEL_FORMAT_A8R8G8B8;
-            break;
-        case DRM_FORMAT_NV12:
-            surf.SlotPixelFormat = VIC_PIXEL_FORMAT_Y8_U8V8_N420;
-            if (op.output().fourcc == DRM_FORMAT_ARGB8888)
-                matrixToFixed(rec601_to_rgb, &c->slotStruct[0].colorMatrixStruct);
-            break;
-        default:
-            return 1;
+    for (unsigned int i = 0; i < VicOp::MAX_SLOTS; i++) {
+        if (!op.input(i).bo)
+            continue;
+
+        int err = buildSlot(op, i, &c->slotStruct[i]);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+int VicDevice::lookupConfig(const VicOp &op, uint32_t *offset)
+{
+    ConfigCacheEntry *victim = &_config_cache[0];
+    size_t config_size = _version == Version::Vic4_1 ? sizeof(ConfigStruct_VIC41)
+                                                     : sizeof(ConfigStruct_VIC40);
+    uint8_t *map;
+    int err;
+
+    _config_clock++;
+
+    for (auto &entry : _config_cache) {
+        if (entry.valid && entry.op.sameConfig(op)) {
+            entry.last_use = _config_clock;
+            *offset = (&entry - &_config_cache[0]) * CONFIG_STRIDE;
+            return 0;
         }
-        switch (in0.format) {
-        case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB:
-            surf.SlotBlkKind = VIC_BLK_KIND_GENERIC_16Bx2;
-            surf.SlotBlkHeight = 1;
-            surf.SlotCacheWidth = VIC_CACHE_WIDTH_32Bx8;
-            break;
-        case DRM_FORMAT_MOD_LINEAR:
-            surf.SlotBlkKind = VIC_BLK_KIND_PITCH;
-            surf.SlotCacheWidth = VIC_CACHE_WIDTH_64Bx4;
-            break;
-        default:
+
+        if (!entry.valid)
+            victim = &entry;
+        else if (victim->valid && entry.last_use < victim->last_use)
+            victim = &entry;
+    }
+
+    map = (uint8_t *)_config_bo.map();
+    if (!map)
+        return 1;
+
+    victim->valid = false;
+
+    err = buildConfig(op, &_config_staging);
+    if (err)
+        return err;
+
+    *offset = (victim - &_config_cache[0]) * CONFIG_STRIDE;
+    memcpy(map + *offset, &_config_staging, config_size);
+
+    victim->op = op;
+    victim->last_use = _config_clock;
+    victim->valid = true;
+
+    return 0;
+}
+
+int VicDevice::run(VicOp &op)
+{
+    return run(&op, 1);
+}
+
+int VicDevice::run(VicOp *ops, size_t count)
+{
+    uint32_t fence;
+    int err;
+
+    err = submit(ops, count, &fence);
+    if (err)
+        return err;
+
+    return wait(fence);
+}
+
+int VicDevice::wait(uint32_t fence)
+{
+    int err;
+
+    if (_sw)
+        return 0;
+
+    err = _dev.waitSyncpoint(_syncpt, fence);
+    if (err)
+        return err;
+
+    if (_pending && _pending_fence == fence)
+        _pending = false;
+
+    return 0;
+}
+
+int VicDevice::sync()
+{
+    if (!_pending)
+        return 0;
+
+    return wait(_pending_fence);
+}
+
+int VicDevice::submit(VicOp *ops, size_t count, uint32_t *fence)
+{
+    uint32_t *cmd;
+    std::array<SurfaceMasks, MAX_BATCH> surface_masks;
+    std::array<bool, MAX_BATCH> histograms;
+    bool rebuild;
+    int err;
+
+    /* The software path completes before returning, so the fence is already reached */
+    if (_sw) {
+        if (count == 0 || count > MAX_BATCH)
             return 1;
-        }
-        surf.SlotSurfaceWidth = in0.width - 1;          // Non-padded width in pixels
-        surf.SlotSurfaceHeight = in0.height - 1;        // Height in pixels
-        surf.SlotLumaWidth = in0.pitch - 1;             // Padded width in pixels
-        surf.SlotLumaHeight = in0.height - 1;           // Height in pixels
-        surf.SlotChromaWidth = (in0.pitch / 2) - 1;     // Padded width in pixels
-        surf.SlotChromaHeight = (in0.height / 2) - 1;   // Height in pixels
 
-        surf.SlotChromaLocHoriz = 1;
-        surf.SlotChromaLocVert = 1;
+        *fence = 0;
+        return _sw->run(ops, count);
     }
 
-    memset(cmd, 0, 0x1000);
-    i = 0;
+    cmd = (uint32_t *)_cmd_bo.map();
+    if (!cmd)
+        return 1;
 
-#define M(name, value) do {\
-    cmd[i++] = host1x_opcode_incr(VIC_UCLASS_METHOD_OFFSET, 2);\
-    cmd[i++] = (name) >> 2;\
-    cmd[i++] = (value);\
-} while (0);
-#define BO(h, offs, rw) do {\
-    err = (h)->channelMap(_context, (rw));\
-    if (err) {\
-        perror("Surface mapping failed");\
-        return err;\
-    }\
-    \
-    drm_tegra_submit_buf __buf = { 0 };\
-    __buf.mapping = (h)->mappingId(_context);\
-    __buf.reloc.target_offset = (offs);\
-    __buf.reloc.gather_offset_words = i-1;\
-    __buf.reloc.shift = 8;\
-    relocs_new.push_back(__buf);\
-    \
-    drm_tegra_reloc __reloc;\
-    __reloc.cmdbuf.handle = _cmd_bo.handle();\
-    __reloc.cmdbuf.offset = (i-1)*4;\
-    __reloc.target.handle = (h)->handle();\
-    __reloc.target.offset = (offs);\
-    __reloc.shift = 8;\
-    __reloc.pad = 0;\
-    relocs.push_back(__reloc);\
-} while(0);
+    /*
+     * The command buffer and cached config/filter entries may still be in
+     * use by the job in flight, so only one is allowed at a time.
+     */
+    err = sync();
+    if (err)
+        return err;
 
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_APPLICATION_ID, 1);
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_CONTROL_PARAMS,
-        ((is41 ? sizeof(ConfigStruct_VIC41) : sizeof(ConfigStruct_VIC40)) / 16) << 16);
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_CONFIG_STRUCT_OFFSET, 0xdeadbeef);
-    BO(&_config_bo, 0, false);
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_FILTER_STRUCT_OFFSET, 0xdeadbeef);
-    BO(&_filter_bo, 0, false);
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_LUMA_OFFSET, 0xdeadbeef);
-    BO(op.output().bo, 0, true);
-    M(NVB0B6_VIDEO_COMPOSITOR_SET_OUTPUT_SURFACE_CHROMA_U_OFFSET, 0xdeadbeef);
-    BO(op.output().bo, op.output().pitch*op.output().paddedHeight(), true);
+    if (count == 0 || count > MAX_BATCH)
+        return 1;
 
-    if (in0.bo) {
-        M(is41 ? NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_LUMA_OFFSET
-               : NVB0B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_LUMA_OFFSET,
-            0xdeadbeef);
-        BO(in0.bo, 0, false);
+    for (size_t pass = 0; pass < count; pass++) {
+        for (unsigned int slot = 0; slot < MAX_SLOTS; slot++)
+            surface_masks[pass][slot] = ops[pass].surfaceMask(slot);
+        histograms[pass] = ops[pass].histogram() != nullptr;
+    }
+
+    rebuild = !_template.valid || _template.num_passes != count;
+    for (size_t pass = 0; !rebuild && pass < count; pass++)
+        rebuild = _template.surface_masks[pass] != surface_masks[pass] ||
+                  _template.histograms[pass] != histograms[pass];
 
-        M(is41 ? NVB1B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_U_OFFSET
-               : NVB0B6_VIDEO_COMPOSITOR_SET_SURFACE0_SLOT0_CHROMA_U_OFFSET,
-               0xdeadbeef);
-        BO(in0.bo, in0.pitch * in0.paddedHeight(), false);
+    if (rebuild) {
+        err = buildTemplate(_template, surface_masks.data(), histograms.data(), count);
+        if (err)
+            return err;
     }
 
-    M(NVB0B6_VIDEO_COMPOSITOR_EXECUTE, (1 << 8));
-    cmd[i++] = host1x_opcode_nonincr(0, 1);
-    cmd[i++] = _syncpt | (1 << (is41 ? 10 : 8));
+    CommandTemplate &t = _template;
+
+    for (size_t pass = 0; pass < count; pass++) {
+        const VicOp &op = ops[pass];
+        const PassRelocs &p = t.passes[pass];
+        uint32_t config_offset, filter_offset;
+
+        err = lookupConfig(op, &config_offset);
+        if (err)
+            return err;
+
+        err = lookupFilter(filterParams(op), &filter_offset);
+        if (err)
+            return err;
+
+        err = patchReloc(t, p.config_reloc, &_config_bo, config_offset, false);
+        if (err)
+            return err;
+
+        err = patchReloc(t, p.filter_reloc, &_filter_bo, filter_offset, false);
+        if (err)
+            return err;
+
+        for (unsigned int plane = 0; plane < PLANES; plane++) {
+            err = patchReloc(t, p.output_reloc + plane, op.output().bo,
+                             op.output().planeOffset(plane), true);
+            if (err)
+                return err;
+        }
+
+        if (histograms[pass]) {
+            err = patchReloc(t, p.hist_reloc, op.histogram(), 0, true);
+            if (err)
+                return err;
+        }
+
+        for (unsigned int slot = 0; slot < MAX_SLOTS; slot++) {
+            for (unsigned int surface = 0; surface < VicOp::SLOT_SURFACES; surface++) {
+                if (!(surface_masks[pass][slot] & (1u << surface)))
+                    continue;
+
+                const VicOp::Surface &in = op.slotSurface(slot, (VicSlotSurface)surface);
+                size_t reloc = p.surface_relocs[slot][surface];
+                bool rw = slotSurfaceWritten(surface);
+
+                for (unsigned int plane = 0; plane < PLANES; plane++) {
+                    err = patchReloc(t, reloc + plane, in.bo, in.planeOffset(plane), rw);
+                    if (err)
+                        return err;
+                }
+            }
+        }
+    }
 
     if (_dev.isNewApi()) {
         drm_tegra_submit_cmd submit_cmds[1] = { 0 };
         submit_cmds[0].type = DRM_TEGRA_SUBMIT_CMD_GATHER_UPTR;
-        submit_cmds[0].gather_uptr.words = i;
+        submit_cmds[0].gather_uptr.words = t.num_words;
 
         drm_tegra_channel_submit submit = { 0 };
         submit.context = _context;
-        submit.num_bufs = relocs_new.size();
+        submit.num_bufs = t.num_relocs;
         submit.num_cmds = 1;
-        submit.gather_data_words = i;
-        submit.bufs_ptr = (__u64)&relocs_new[0];
+        submit.gather_data_words = t.num_words;
+        submit.bufs_ptr = (__u64)t.bufs.data();
         submit.cmds_ptr = (__u64)&submit_cmds[0];
-        submit.gather_data_ptr = (__u64)&cmd[0];
+        submit.gather_data_ptr = (__u64)t.words.data();
         submit.syncpt.id = _syncpt;
-        submit.syncpt.increments = 1;
+        submit.syncpt.increments = t.num_passes;
 
         err = _dev.ioctl(DRM_IOCTL_TEGRA_CHANNEL_SUBMIT, &submit);
         if (err == -1) {
@@ -370,28 +1538,31 @@ int VicDevice::run(VicOp &op)
             return err;
         }
 
-        err = _dev.waitSyncpoint(_syncpt, submit.syncpt.value);
-        if (err)
-            return err;
+        *fence = submit.syncpt.value;
     } else {
+        if (!t.uploaded) {
+            memcpy(cmd, t.words.data(), t.num_words * 4);
+            t.uploaded = true;
+        }
+
         drm_tegra_syncpt incr;
         incr.id = _syncpt;
-        incr.incrs = 1;
+        incr.incrs = t.num_passes;
 
         drm_tegra_cmdbuf cmdbuf;
         cmdbuf.handle = _cmd_bo.handle();
         cmdbuf.offset = 0;
-        cmdbuf.words = i;
+        cmdbuf.words = t.num_words;
 
         drm_tegra_submit submit;
         memset(&submit, 0, sizeof(submit));
         submit.context = _context;
         submit.num_syncpts = 1;
         submit.num_cmdbufs = 1;
-        submit.num_relocs = relocs.size();
+        submit.num_relocs = t.num_relocs;
         submit.syncpts = (uintptr_t)&incr;
         submit.cmdbufs = (uintptr_t)&cmdbuf;
-        submit.relocs = (uintptr_t)&relocs[0];
+        submit.relocs = (uintptr_t)t.relocs.data();
 
         err = _dev.ioctl(DRM_IOCTL_TEGRA_SUBMIT, &submit);
         if (err == -1) {
@@ -399,8 +1570,11 @@ int VicDevice::run(VicOp &op)
             return err;
         }
 
-        return _dev.waitSyncpoint(_syncpt, submit.fence);
+        *fence = submit.fence;
     }
 
+    _pending = true;
+    _pending_fence = *fence;
+
     return 0;
 }
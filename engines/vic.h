@@ -26,11 +26,62 @@
 
 #include <linux/kernel.h>
 #include "../gem.h"
+#include "../engine_headers/vic04.h"
+#include "../uapi_headers/tegra_drm.h"
+
+#include <array>
+#include <memory>
+
+enum class VicColorStandard {
+    BT601,
+    BT709,
+    BT2020
+};
+
+enum class VicColorRange {
+    Limited,
+    Full
+};
+
+enum class VicCscDirection {
+    YuvToRgb,
+    RgbToYuv
+};
+
+enum class VicFilter {
+    Nearest,
+    Bilinear,
+    Bicubic,
+    Lanczos
+};
+
+enum class VicDeinterlace {
+    None,
+    Weave,
+    Bob,
+    MotionAdaptive
+};
+
+// Surfaces of a single slot, in the order of the slot surface methods
+enum class VicSlotSurface {
+    Current,
+    Previous,
+    Next,
+    NextNoiseReduced,
+    CurrentMotion,
+    PreviousMotion,
+    PpMotion,
+    CombinedMotion
+};
 
 class VicOp {
 public:
+    // Slots in ConfigStruct_VIC41, VIC 4.0 only has the first 8
+    static constexpr size_t MAX_SLOTS = 16;
+    static constexpr size_t SLOT_SURFACES = 8;
+
     struct Surface {
-        Surface() : bo(nullptr), x(0), y(0), width(0), height(0), pitch(0)
+        Surface() : bo(nullptr), x(0), y(0), width(0), height(0), pitch(0), fourcc(0), format(0)
         { }
 
         GemBuffer *bo;
@@ -44,27 +95,205 @@ public:
         unsigned int paddedHeight() const {
             return __ALIGN_KERNEL(height, 16);
         }
+
+        // Byte offset of plane 0 (luma), 1 (chroma U) or 2 (chroma V) in the buffer.
+        // Single plane surfaces point all planes at the first one
+        uint32_t planeOffset(unsigned int plane) const;
+        // Bytes taken by all planes, laid out as planeOffset() describes
+        uint32_t size() const;
+
+        // Compares everything but the backing buffer itself
+        bool sameLayout(const Surface &other) const;
+        // Same as sameLayout(), without caring whether either one has a buffer
+        bool sameFormat(const Surface &other) const;
+    };
+
+    struct Rect {
+        Rect() : x(0), y(0), width(0), height(0)
+        { }
+
+        Rect(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+        : x(x), y(y), width(width), height(height)
+        { }
+
+        // All in pixels
+        unsigned int x, y;
+        unsigned int width, height;
+
+        bool empty() const { return width == 0 || height == 0; }
+        bool operator==(const Rect &other) const {
+            return x == other.x && y == other.y &&
+                   width == other.width && height == other.height;
+        }
+    };
+
+    struct Deinterlace {
+        Deinterlace() : mode(VicDeinterlace::None), bottom_field(false), bottom_field_first(false)
+        { }
+
+        VicDeinterlace mode;
+        // Field of the current surface to output, and field order of the stream
+        bool bottom_field;
+        bool bottom_field_first;
+
+        bool operator==(const Deinterlace &other) const {
+            return mode == other.mode && bottom_field == other.bottom_field &&
+                   bottom_field_first == other.bottom_field_first;
+        }
+    };
+
+    // Matrix coefficients/primaries and quantization range of YUV data. RGB
+    // data is always full range with BT.709 primaries
+    struct ColorSpace {
+        ColorSpace() : standard(VicColorStandard::BT601), range(VicColorRange::Limited)
+        { }
+
+        ColorSpace(VicColorStandard standard, VicColorRange range)
+        : standard(standard), range(range)
+        { }
+
+        VicColorStandard standard;
+        VicColorRange range;
+
+        bool operator==(const ColorSpace &other) const {
+            return standard == other.standard && range == other.range;
+        }
+    };
+
+    // Alpha blending of a slot over the slots below it
+    struct Blend {
+        Blend() : enabled(false), global_alpha(1.0f), premultiplied(false)
+        { }
+
+        bool enabled;
+        float global_alpha;
+        // Whether color channels are already multiplied by per-pixel alpha
+        bool premultiplied;
+
+        bool operator==(const Blend &other) const {
+            return enabled == other.enabled && global_alpha == other.global_alpha &&
+                   premultiplied == other.premultiplied;
+        }
     };
 
     VicOp();
 
     void setOutput(VicOp::Surface surf);
     void setSurface(unsigned int idx, VicOp::Surface surf);
+    // Reference and history surfaces share the layout of the slot's current surface
+    void setSlotSurface(unsigned int idx, VicSlotSurface which, VicOp::Surface surf);
+    void setDeinterlace(unsigned int idx, VicOp::Deinterlace deinterlace);
+    // Noise reduction strength from 0.0 (off) to 1.0
+    void setDenoise(unsigned int idx, float strength);
+    void setBlend(unsigned int idx, VicOp::Blend blend);
     void setClear(float r, float g, float b);
+    // Empty rectangles select the whole input surface / output surface
+    void setSourceRect(unsigned int idx, VicOp::Rect rect);
+    void setDestRect(unsigned int idx, VicOp::Rect rect);
+    // Part of the output VIC writes to, the rest is left untouched. Empty is the whole output
+    void setTargetRect(VicOp::Rect rect);
+    // Slots are converted to the output color space when they differ from it
+    void setColorSpace(unsigned int idx, VicOp::ColorSpace color_space);
+    void setOutputColorSpace(VicOp::ColorSpace color_space);
+    void setFilter(VicFilter filter);
+    // Output orientation, transposition is applied before flipping
+    void setOrientation(bool flip_x, bool flip_y, bool transpose);
+    // Buffer of at least VicDevice::HISTOGRAM_SIZE bytes receiving the output histogram, or null
+    void setHistogram(GemBuffer *bo);
 
     const VicOp::Surface &output() const { return _output; }
-    const VicOp::Surface &input(unsigned int idx) const { return _inputs[idx]; }
+    const VicOp::Surface &input(unsigned int idx) const { return _inputs[idx][0]; }
+    const VicOp::Surface &slotSurface(unsigned int idx, VicSlotSurface which) const {
+        return _inputs[idx][(int)which];
+    }
+    const VicOp::Deinterlace &deinterlace(unsigned int idx) const { return _deinterlace[idx]; }
+    float denoise(unsigned int idx) const { return _denoise[idx]; }
+    const VicOp::Blend &blend(unsigned int idx) const { return _blend[idx]; }
     float clearR() const { return _clear_r; }
     float clearG() const { return _clear_g; }
     float clearB() const { return _clear_b; }
+    const VicOp::Rect &sourceRect(unsigned int idx) const { return _source_rects[idx]; }
+    const VicOp::Rect &destRect(unsigned int idx) const { return _dest_rects[idx]; }
+    const VicOp::Rect &targetRect() const { return _target_rect; }
+    const VicOp::ColorSpace &colorSpace(unsigned int idx) const { return _color_spaces[idx]; }
+    const VicOp::ColorSpace &outputColorSpace() const { return _output_color_space; }
+    VicFilter filter() const { return _filter; }
+    bool flipX() const { return _flip_x; }
+    bool flipY() const { return _flip_y; }
+    bool transpose() const { return _transpose; }
+    GemBuffer *histogram() const { return _histogram; }
+
+    // Destination rectangle of a slot before the output orientation is applied
+    VicOp::Rect composedDestRect(unsigned int idx) const;
+    VicOp::Rect composedTargetRect() const;
+
+    // Bit n is set if surface n of the slot is present, VicSlotSurface order
+    uint8_t surfaceMask(unsigned int idx) const;
+
+    // True if both ops result in the same VIC configuration struct
+    bool sameConfig(const VicOp &other) const;
 
 private:
     VicOp::Surface _output;
-    VicOp::Surface _inputs[1];
+    // Slots are composited in order, the last one ending up on top
+    VicOp::Surface _inputs[MAX_SLOTS][SLOT_SURFACES];
+    VicOp::Deinterlace _deinterlace[MAX_SLOTS];
+    float _denoise[MAX_SLOTS];
+    VicOp::Blend _blend[MAX_SLOTS];
+    VicOp::Rect _source_rects[MAX_SLOTS];
+    VicOp::Rect _dest_rects[MAX_SLOTS];
+    VicOp::Rect _target_rect;
+    VicOp::ColorSpace _color_spaces[MAX_SLOTS];
+    VicOp::ColorSpace _output_color_space;
+
+    VicOp::Rect composed(VicOp::Rect rect) const;
 
     float _clear_r, _clear_g, _clear_b;
+    VicFilter _filter;
+    bool _flip_x, _flip_y, _transpose;
+    GemBuffer *_histogram;
+};
+
+// Color matrices VIC is configured with, as 3 rows of 4 floats on normalized values, the last
+// column being the offset. Gamut matrices have no offset
+void vicCscMatrix(VicColorStandard standard, VicColorRange range, VicCscDirection direction,
+                  float m[12]);
+void vicGamutMatrix(VicColorStandard from, VicColorStandard to, float m[12]);
+
+/*
+ * Surfaces VIC reads back on following frames of a stream, like the motion
+ * maps of motion-adaptive deinterlacing and the noise-reduced previous frame
+ * of temporal denoising. Owned by whoever owns the stream.
+ */
+class VicHistory {
+public:
+    VicHistory(DrmDevice &dev);
+
+    // Attaches history surfaces to slot idx of op, to be called once per frame
+    int apply(VicOp &op, unsigned int idx);
+    void reset();
+
+private:
+    static constexpr size_t MOTION_FIELDS = 3;
+    static constexpr size_t DENOISE_FRAMES = 2;
+
+    DrmDevice &_dev;
+    VicOp::Surface _layout;
+
+    std::array<std::unique_ptr<GemBuffer>, MOTION_FIELDS> _motion;
+    unsigned int _motion_index;
+    unsigned int _motion_valid;
+
+    // Written as the noise-reduced field, then read back as the previous one
+    std::array<std::unique_ptr<GemBuffer>, DENOISE_FRAMES> _denoise;
+    unsigned int _denoise_index;
+    bool _denoise_valid;
+
+    int allocate(const VicOp::Surface &layout);
 };
 
+class VicSoftware;
+
 class VicDevice {
 public:
     VicDevice(DrmDevice &dev);
@@ -72,8 +301,49 @@ public:
 
     int open();
     int run(VicOp &op);
+    // Runs ops back to back in one submission, completing on a single fence
+    int run(VicOp *ops, size_t count);
+
+    // Same as run() without waiting, fence is the syncpoint value reached on completion
+    int submit(VicOp *ops, size_t count, uint32_t *fence);
+    int wait(uint32_t fence);
+    // Waits for the submission in flight, if any
+    int sync();
+
+    // Number of slots the opened VIC version supports
+    unsigned int maxSlots() const { return _sw || _version == Version::Vic4_1 ? 16 : 8; }
+    // Whether open() fell back to VicSoftware instead of the hardware engine
+    bool isSoftware() const { return _sw != nullptr; }
+
+    static constexpr size_t MAX_SLOTS = VicOp::MAX_SLOTS;
+    static constexpr size_t MAX_BATCH = 4;
+    // Luma histogram of the output, 256 bins of 32-bit pixel counts
+    static constexpr size_t HISTOGRAM_BINS = 256;
+    static constexpr size_t HISTOGRAM_SIZE = HISTOGRAM_BINS * 4;
 
 private:
+    // Config, filter, histogram and output luma/chroma U/chroma V, plus the same for each
+    // slot surface
+    static constexpr size_t PLANES = 3;
+    static constexpr size_t PASS_RELOCS = 3 + PLANES + PLANES * MAX_SLOTS * VicOp::SLOT_SURFACES;
+    static constexpr size_t MAX_RELOCS = MAX_BATCH * PASS_RELOCS;
+    static constexpr size_t MAX_CMD_WORDS = 0x5000 / 4;
+
+    // Config structs are cached in _config_bo, at 256-byte aligned offsets for the relocation shift
+    static constexpr size_t CONFIG_CACHE_SIZE = 8;
+    static constexpr size_t CONFIG_STRIDE = __ALIGN_KERNEL(sizeof(ConfigStruct_VIC41), 256);
+
+    // Same for filter tables in _filter_bo, keyed by filter and quantized scaling ratio
+    static constexpr size_t FILTER_CACHE_SIZE = 8;
+    static constexpr size_t FILTER_STRIDE = __ALIGN_KERNEL(sizeof(FilterStruct), 256);
+    // Scaling ratios are quantized to 1/FILTER_RATIO_STEPS, up to 16x downscaling
+    static constexpr unsigned int FILTER_RATIO_STEPS = 8;
+    static constexpr unsigned int FILTER_MAX_RATIO = 16 * FILTER_RATIO_STEPS;
+
+    // Entries used by a batch must not evict each other before it is submitted
+    static_assert(MAX_BATCH <= CONFIG_CACHE_SIZE && MAX_BATCH <= FILTER_CACHE_SIZE,
+                  "Batch does not fit in the config and filter caches");
+
     DrmDevice &_dev;
 
     enum Version {
@@ -84,7 +354,92 @@ private:
 
     uint64_t _context;
     uint32_t _syncpt;
+    bool _pending;
+    uint32_t _pending_fence;
     GemBuffer _cmd_bo, _config_bo, _filter_bo;
+
+    // CPU fallback when there is no usable VIC, ops then complete within submit()
+    std::unique_ptr<VicSoftware> _sw;
+
+    typedef std::array<uint8_t, MAX_SLOTS> SurfaceMasks;
+
+    // Relocations of one op of a batch, each op being executed separately
+    struct PassRelocs {
+        size_t config_reloc;
+        size_t filter_reloc;
+        // Only there if the op writes a histogram
+        size_t hist_reloc;
+
+        // Plane p of the output is relocation output_reloc + p, plane p of surface m of
+        // slot n is surface_relocs[n][m] + p
+        size_t output_reloc;
+        std::array<std::array<size_t, VicOp::SLOT_SURFACES>, MAX_SLOTS> surface_relocs;
+    };
+
+    /*
+     * Command stream for a given set of slot surfaces and histogram outputs of
+     * each op. It is rebuilt only when that changes; otherwise just the
+     * relocations are patched.
+     */
+    struct CommandTemplate {
+        bool valid;
+        bool uploaded;
+        size_t num_passes;
+        std::array<SurfaceMasks, MAX_BATCH> surface_masks;
+        std::array<bool, MAX_BATCH> histograms;
+        size_t num_words;
+        size_t num_relocs;
+
+        std::array<PassRelocs, MAX_BATCH> passes;
+
+        std::array<uint32_t, MAX_CMD_WORDS> words;
+        std::array<drm_tegra_reloc, MAX_RELOCS> relocs;
+        std::array<drm_tegra_submit_buf, MAX_RELOCS> bufs;
+    } _template;
+
+    struct ConfigCacheEntry {
+        bool valid;
+        uint32_t last_use;
+        VicOp op;
+    };
+    std::array<ConfigCacheEntry, CONFIG_CACHE_SIZE> _config_cache;
+    uint32_t _config_clock;
+    ConfigStruct_VIC41 _config_staging;
+
+    /*
+     * Filter table for one filter at one scaling ratio per direction. The
+     * tap counts are derived from the same, and end up in FilterLengthX/Y.
+     */
+    struct FilterParams {
+        VicFilter filter;
+        unsigned int ratio_x, ratio_y;
+        unsigned int taps_x, taps_y;
+
+        bool operator==(const FilterParams &other) const {
+            return filter == other.filter &&
+                   ratio_x == other.ratio_x && ratio_y == other.ratio_y;
+        }
+    };
+
+    struct FilterCacheEntry {
+        bool valid;
+        uint32_t last_use;
+        FilterParams params;
+    };
+    std::array<FilterCacheEntry, FILTER_CACHE_SIZE> _filter_cache;
+    uint32_t _filter_clock;
+    FilterStruct _filter_staging;
+
+    static FilterParams filterParams(const VicOp &op);
+    static void buildFilter(const FilterParams &params, FilterStruct *f);
+    int lookupFilter(const FilterParams &params, uint32_t *offset);
+
+    int buildSlot(const VicOp &op, unsigned int idx, SlotStruct *s);
+    int buildConfig(const VicOp &op, ConfigStruct_VIC41 *c);
+    int lookupConfig(const VicOp &op, uint32_t *offset);
+    int buildTemplate(CommandTemplate &t, const SurfaceMasks *surface_masks,
+                      const bool *histograms, size_t count);
+    int patchReloc(CommandTemplate &t, size_t idx, GemBuffer *bo, uint32_t offset, bool rw);
 };
 
 #endif // GEM_H
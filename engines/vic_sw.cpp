@@ -0,0 +1,970 @@
+/* kate: replace-tabs true; indent-width 4
+ *
+ * Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#include "vic.h"
+#include "vic_sw.h"
+#include <libdrm/drm_fourcc.h>
+
+/*
+ * One component of four neighbouring pixels, operated on with the compiler's
+ * generic vector extension so it becomes NEON on arm64 and SSE on x86 without
+ * intrinsics. Rows are kept as one float array per component.
+ */
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+static inline v4f splat(float v) {
+    return v4f{ v, v, v, v };
+}
+
+static inline v4f load(const float *p) {
+    v4f v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store(float *p, v4f v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline v4f clamp01(v4f v) {
+    v4f zero = splat(0.0f), one = splat(1.0f);
+
+    v = v < zero ? zero : v;
+    return v > one ? one : v;
+}
+
+static inline uint8_t toByte(float v) {
+    return (uint8_t)(v * 255.0f + 0.5f);
+}
+
+/* Rounded to 0..max, from values clamped to 0..1 */
+static inline v4i toLevels(v4f v, float max) {
+    return __builtin_convertvector(v * splat(max) + splat(0.5f), v4i);
+}
+
+/*
+ * Byte offset of byte x of row y in a 16Bx2 block linear plane with two-GOB
+ * blocks. GOBs are 64 bytes by 8 rows and blocks are laid out row-major,
+ * pitch / 64 of them per row.
+ */
+static inline size_t blockLinearOffset(unsigned int x, unsigned int y, unsigned int pitch) {
+    size_t block = (size_t)(y / 16) * (pitch / 64) + x / 64;
+    size_t gob = (y % 16) / 8;
+    size_t in_gob = ((x % 64) / 32) * 256 + ((y % 8) / 2) * 64 +
+                    ((x % 32) / 16) * 32 + (y % 2) * 16 + x % 16;
+
+    return block * 1024 + gob * 512 + in_gob;
+}
+
+struct Plane {
+    uint8_t *base;
+    // In bytes
+    unsigned int pitch;
+    bool block_linear;
+};
+
+/*
+ * Bytes x0..x1-1 of row y. Linear rows are read in place, block linear ones
+ * are gathered into tmp in the 16 byte runs that are contiguous in a GOB.
+ */
+static const uint8_t *loadRow(const Plane &p, unsigned int x0, unsigned int x1, unsigned int y,
+                              uint8_t *tmp) {
+    if (!p.block_linear)
+        return p.base + (size_t)y * p.pitch + x0;
+
+    for (unsigned int x = x0; x < x1;) {
+        unsigned int run = std::min(16 - x % 16, x1 - x);
+        memcpy(tmp + (x - x0), p.base + blockLinearOffset(x, y, p.pitch), run);
+        x += run;
+    }
+
+    return tmp;
+}
+
+/*
+ * Bytes x0..x1-1 of row y to be written and passed to storeRow(), holding the
+ * current contents if keep is set.
+ */
+static uint8_t *beginRow(const Plane &p, unsigned int x0, unsigned int x1, unsigned int y,
+                         uint8_t *tmp, bool keep) {
+    if (!p.block_linear)
+        return p.base + (size_t)y * p.pitch + x0;
+
+    if (keep)
+        loadRow(p, x0, x1, y, tmp);
+
+    return tmp;
+}
+
+static void storeRow(const Plane &p, unsigned int x0, unsigned int x1, unsigned int y,
+                     const uint8_t *row) {
+    if (!p.block_linear)
+        return;
+
+    for (unsigned int x = x0; x < x1;) {
+        unsigned int run = std::min(16 - x % 16, x1 - x);
+        memcpy(p.base + blockLinearOffset(x, y, p.pitch), row + (x - x0), run);
+        x += run;
+    }
+}
+
+static bool isYuv(uint32_t fourcc) {
+    return fourcc == DRM_FORMAT_NV12 || fourcc == DRM_FORMAT_YUV420 ||
+           fourcc == DRM_FORMAT_YVU420;
+}
+static int mapSurface(const VicOp::Surface &s, Plane planes[3]) {
+    unsigned int pitches[3];
+    bool block_linear;
+
+    switch (s.format) {
+    case DRM_FORMAT_MOD_LINEAR:
+        block_linear = false;
+        break;
+    case DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB:
+        block_linear = true;
+        break;
+    default:
+        return 1;
+    }
+
+    switch (s.fourcc) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XBGR8888:
+        pitches[0] = pitches[1] = pitches[2] = s.pitch * 4;
+        break;
+    case DRM_FORMAT_RGB565:
+        pitches[0] = pitches[1] = pitches[2] = s.pitch * 2;
+        break;
+    case DRM_FORMAT_NV12:
+        pitches[0] = pitches[1] = pitches[2] = s.pitch;
+        break;
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        pitches[0] = s.pitch;
+        pitches[1] = pitches[2] = s.pitch / 2;
+        break;
+    default:
+        return 1;
+    }
+
+    uint8_t *base = (uint8_t *)s.bo->map();
+    if (!base)
+        return 1;
+
+    for (unsigned int p = 0; p < 3; p++) {
+        if (block_linear && pitches[p] % 64)
+            return 1;
+
+        planes[p].base = base + s.planeOffset(p);
+        planes[p].pitch = pitches[p];
+        planes[p].block_linear = block_linear;
+    }
+
+    return 0;
+}
+
+/*
+ * Affine color transform, row-major with the offset in the last column.
+ * Alpha is not transformed.
+ */
+struct Transform {
+    float m[12];
+
+    /* Component i for four pixels */
+    v4f apply(unsigned int i, v4f c0, v4f c1, v4f c2) const {
+        return splat(m[i*4+0]) * c0 + splat(m[i*4+1]) * c1 + splat(m[i*4+2]) * c2 +
+               splat(m[i*4+3]);
+    }
+};
+
+static const float identity_matrix[12] = {
+    1.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f, 0.0f,
+};
+
+static Transform toTransform(const float m[12]) {
+    Transform t;
+
+    memcpy(t.m, m, sizeof(t.m));
+
+    return t;
+}
+
+/* a applied after b, a having no offset */
+static void multiply(const float a[12], const float b[12], float r[12]) {
+    for (unsigned int i = 0; i < 3; i++)
+        for (unsigned int j = 0; j < 4; j++)
+            r[i*4+j] = a[i*4+0] * b[0*4+j] + a[i*4+1] * b[1*4+j] + a[i*4+2] * b[2*4+j];
+}
+
+struct Slot {
+    uint32_t fourcc;
+    Plane planes[3];
+
+    // Bob deinterlacing samples the rows of one field only
+    bool bob;
+    unsigned int field;
+
+    // Composition space rectangle covered by the slot
+    VicOp::Rect dst;
+    // Inclusive source bounds and mapping of composition rows to source rows,
+    // in field rows when deinterlacing
+    int min_x, max_x, min_y, max_y;
+    float origin_y, step_y;
+    // For each column of dst, the two source columns sampled and the weight
+    // of the second one
+    std::vector<int> col0, col1;
+    std::vector<float> col_weight;
+    bool nearest;
+
+    bool blend;
+    bool pixel_alpha;
+    bool premultiplied;
+    float global_alpha;
+
+    // To RGB in the output primaries
+    Transform transform;
+};
+
+/* Floats a transposed band keeps per composition row, with room for writes past the end */
+static constexpr unsigned int TILE_STRIDE = VicSoftware::BAND_ROWS + 4;
+
+/* Per-thread buffers, sized by prepareJob() before the bands are handed out */
+struct Scratch {
+    // Composited RGB of one row, or of a whole band when transposing
+    std::vector<float> tile[3];
+    // RGB of one output row, when it has to be reordered from the tile
+    std::vector<float> row[3];
+    // U and V of a pair of output rows, for 4:2:0 subsampling
+    std::vector<float> uv[2][2];
+    // Two unpacked source rows
+    std::vector<float> src[2][4];
+    // Block linear rows on their way to or from memory
+    std::vector<uint8_t> bytes;
+};
+
+struct VicSoftware::Job {
+    std::array<Slot, VicOp::MAX_SLOTS> slots;
+    unsigned int num_slots;
+
+    uint32_t out_fourcc;
+    Plane out_planes[3];
+    unsigned int width, height;
+    bool flip_x, flip_y, transpose;
+    VicOp::Rect target;
+    float clear[3];
+    // From composition RGB to the output YUV, unused for RGB outputs
+    Transform out_transform;
+
+    uint32_t *histogram;
+    std::mutex histogram_lock;
+
+    unsigned int num_bands;
+    std::atomic<unsigned int> next_band;
+
+    // Index 0 is the calling thread, then one per worker
+    std::vector<Scratch> scratch;
+};
+
+/*
+ * Source columns lo..hi of row y as normalized components, YUV or RGB, with
+ * alpha in the last one for ARGB.
+ */
+static void unpackRow(const Slot &s, int y, int lo, int hi, uint8_t *tmp, float *const out[4]) {
+    unsigned int row = y, chroma_row = y / 2;
+    unsigned int count = hi - lo + 1;
+    const float k = 1.0f / 255.0f;
+
+    /* Chroma rows are interleaved by field too */
+    if (s.bob) {
+        row = y * 2 + s.field;
+        chroma_row = (y / 2) * 2 + s.field;
+    }
+
+    switch (s.fourcc) {
+    case DRM_FORMAT_ARGB8888: {
+        const uint8_t *p = loadRow(s.planes[0], lo * 4, (hi + 1) * 4, row, tmp);
+        for (unsigned int i = 0; i < count; i++, p += 4) {
+            out[0][i] = p[2] * k;
+            out[1][i] = p[1] * k;
+            out[2][i] = p[0] * k;
+            out[3][i] = p[3] * k;
+        }
+        break;
+    }
+    case DRM_FORMAT_XBGR8888: {
+        const uint8_t *p = loadRow(s.planes[0], lo * 4, (hi + 1) * 4, row, tmp);
+        for (unsigned int i = 0; i < count; i++, p += 4) {
+            out[0][i] = p[0] * k;
+            out[1][i] = p[1] * k;
+            out[2][i] = p[2] * k;
+        }
+        break;
+    }
+    case DRM_FORMAT_RGB565: {
+        const uint8_t *p = loadRow(s.planes[0], lo * 2, (hi + 1) * 2, row, tmp);
+        for (unsigned int i = 0; i < count; i++, p += 2) {
+            unsigned int v = p[0] | (p[1] << 8);
+            out[0][i] = (v >> 11) / 31.0f;
+            out[1][i] = ((v >> 5) & 0x3f) / 63.0f;
+            out[2][i] = (v & 0x1f) / 31.0f;
+        }
+        break;
+    }
+    case DRM_FORMAT_NV12: {
+        const uint8_t *luma = loadRow(s.planes[0], lo, hi + 1, row, tmp);
+        for (unsigned int i = 0; i < count; i++)
+            out[0][i] = luma[i] * k;
+
+        const uint8_t *uv = loadRow(s.planes[1], (lo / 2) * 2, (hi / 2 + 1) * 2, chroma_row, tmp);
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int j = (lo + i) / 2 - lo / 2;
+            out[1][i] = uv[j * 2] * k;
+            out[2][i] = uv[j * 2 + 1] * k;
+        }
+        break;
+    }
+    default: {
+        /* YUV420 and YVU420, the plane order being handled by the plane offsets */
+        const uint8_t *luma = loadRow(s.planes[0], lo, hi + 1, row, tmp);
+        for (unsigned int i = 0; i < count; i++)
+            out[0][i] = luma[i] * k;
+
+        for (unsigned int p = 1; p < 3; p++) {
+            const uint8_t *chroma = loadRow(s.planes[p], lo / 2, hi / 2 + 1, chroma_row, tmp);
+            for (unsigned int i = 0; i < count; i++)
+                out[p][i] = chroma[(lo + i) / 2 - lo / 2] * k;
+        }
+        break;
+    }
+    }
+}
+
+/*
+ * Composites columns cx0..cx1-1 of composition row cy into one array per RGB
+ * component, up to 3 floats past the end being overwritten. Each slot is
+ * sampled bilinearly or nearest, pixel centers being at .5: rows first, on
+ * the source columns the span needs, then columns four pixels at a time.
+ * The affine color transform commutes with the interpolation, so it is
+ * applied on the result.
+ */
+static void composeSpan(const VicSoftware::Job &job, Scratch &scratch, unsigned int cy,
+                        unsigned int cx0, unsigned int cx1, float *const rgb[3]) {
+    unsigned int n = cx1 - cx0;
+
+    for (unsigned int c = 0; c < 3; c++)
+        for (unsigned int i = 0; i < n; i += 4)
+            store(rgb[c] + i, splat(job.clear[c]));
+
+    for (unsigned int k = 0; k < job.num_slots; k++) {
+        const Slot &s = job.slots[k];
+
+        if (cy < s.dst.y || cy >= s.dst.y + s.dst.height)
+            continue;
+
+        unsigned int first = std::max(cx0, s.dst.x);
+        unsigned int last = std::min(cx1, s.dst.x + s.dst.width);
+        if (first >= last)
+            continue;
+
+        unsigned int count = last - first;
+        const int *col0 = s.col0.data() + (first - s.dst.x);
+        const int *col1 = s.col1.data() + (first - s.dst.x);
+        const float *col_weight = s.col_weight.data() + (first - s.dst.x);
+        int lo = col0[0], hi = col1[count - 1];
+        unsigned int components = s.pixel_alpha ? 4 : 3;
+
+        float y = s.origin_y + cy * s.step_y;
+        int y0, y1;
+        float wy = 0.0f;
+
+        if (s.nearest) {
+            y0 = y1 = std::min(std::max((int)floorf(y), s.min_y), s.max_y);
+        } else {
+            y -= 0.5f;
+            float fy = floorf(y);
+            wy = y - fy;
+            y0 = std::min(std::max((int)fy, s.min_y), s.max_y);
+            y1 = std::min(std::max((int)fy + 1, s.min_y), s.max_y);
+        }
+
+        float *top[4], *bottom[4];
+        for (unsigned int c = 0; c < 4; c++) {
+            top[c] = scratch.src[0][c].data();
+            bottom[c] = scratch.src[1][c].data();
+        }
+
+        unpackRow(s, y0, lo, hi, scratch.bytes.data(), top);
+        if (y1 != y0 && wy != 0.0f) {
+            unpackRow(s, y1, lo, hi, scratch.bytes.data(), bottom);
+
+            for (unsigned int c = 0; c < components; c++)
+                for (int i = 0; i <= hi - lo; i += 4) {
+                    v4f t = load(top[c] + i);
+                    store(top[c] + i, t + (load(bottom[c] + i) - t) * splat(wy));
+                }
+        }
+
+        float *out[3] = { rgb[0] + (first - cx0), rgb[1] + (first - cx0), rgb[2] + (first - cx0) };
+        v4f global_alpha = splat(s.global_alpha);
+
+        for (unsigned int i = 0; i < count; i += 4) {
+            int a[4], b[4];
+            v4f wx;
+
+            /* Lanes past the end repeat the last pixel and are dropped below */
+            for (unsigned int l = 0; l < 4; l++) {
+                unsigned int j = std::min(i + l, count - 1);
+                a[l] = col0[j] - lo;
+                b[l] = col1[j] - lo;
+                wx[l] = col_weight[j];
+            }
+
+            v4f texel[4];
+            for (unsigned int c = 0; c < components; c++) {
+                const float *p = top[c];
+                v4f left = v4f{ p[a[0]], p[a[1]], p[a[2]], p[a[3]] };
+                v4f right = v4f{ p[b[0]], p[b[1]], p[b[2]], p[b[3]] };
+                texel[c] = left + (right - left) * wx;
+            }
+
+            v4f color[3];
+            for (unsigned int c = 0; c < 3; c++)
+                color[c] = s.transform.apply(c, texel[0], texel[1], texel[2]);
+
+            /* Source over, with per-pixel alpha scaled by the global alpha */
+            if (s.blend) {
+                v4f alpha = s.pixel_alpha ? global_alpha * texel[3] : global_alpha;
+                v4f src_factor = s.premultiplied ? global_alpha : alpha;
+
+                for (unsigned int c = 0; c < 3; c++)
+                    color[c] = color[c] * src_factor + load(out[c] + i) * (splat(1.0f) - alpha);
+            }
+
+            int left = count - i;
+            v4i keep = v4i{ 0, 1, 2, 3 } >= v4i{ left, left, left, left };
+            for (unsigned int c = 0; c < 3; c++)
+                store(out[c] + i, keep ? load(out[c] + i) : color[c]);
+        }
+    }
+}
+
+template <uint32_t fourcc>
+static void packRgb(const float *const rgb[3], unsigned int n, uint8_t *out,
+                    uint32_t *histogram) {
+    for (unsigned int i = 0; i < n; i += 4) {
+        v4f r = clamp01(load(rgb[0] + i));
+        v4f g = clamp01(load(rgb[1] + i));
+        v4f b = clamp01(load(rgb[2] + i));
+        unsigned int lanes = std::min(n - i, 4u);
+
+        if (fourcc == DRM_FORMAT_RGB565) {
+            v4i r5 = toLevels(r, 31.0f), g6 = toLevels(g, 63.0f), b5 = toLevels(b, 31.0f);
+            v4i v = r5 << 11 | g6 << 5 | b5;
+
+            for (unsigned int l = 0; l < lanes; l++) {
+                out[(i + l) * 2] = v[l] & 0xff;
+                out[(i + l) * 2 + 1] = v[l] >> 8;
+            }
+        } else {
+            v4i r8 = toLevels(r, 255.0f), g8 = toLevels(g, 255.0f), b8 = toLevels(b, 255.0f);
+            bool bgr = fourcc == DRM_FORMAT_ARGB8888;
+
+            for (unsigned int l = 0; l < lanes; l++) {
+                uint8_t *p = out + (i + l) * 4;
+                p[0] = bgr ? b8[l] : r8[l];
+                p[1] = g8[l];
+                p[2] = bgr ? r8[l] : b8[l];
+                p[3] = 0xff;
+            }
+        }
+
+        if (histogram) {
+            v4i luma = toLevels(splat(0.2126f) * r + splat(0.7152f) * g + splat(0.0722f) * b,
+                                255.0f);
+            for (unsigned int l = 0; l < lanes; l++)
+                histogram[luma[l]]++;
+        }
+    }
+}
+
+/* Luma bytes, keeping U and V as floats for outputChroma() */
+static void packLuma(const Transform &t, const float *const rgb[3], unsigned int n,
+                     uint8_t *out, float *u, float *v, uint32_t *histogram) {
+    for (unsigned int i = 0; i < n; i += 4) {
+        v4f r = load(rgb[0] + i), g = load(rgb[1] + i), b = load(rgb[2] + i);
+        v4i luma = toLevels(clamp01(t.apply(0, r, g, b)), 255.0f);
+        unsigned int lanes = std::min(n - i, 4u);
+
+        store(u + i, clamp01(t.apply(1, r, g, b)));
+        store(v + i, clamp01(t.apply(2, r, g, b)));
+
+        for (unsigned int l = 0; l < lanes; l++)
+            out[i + l] = luma[l];
+
+        if (histogram)
+            for (unsigned int l = 0; l < lanes; l++)
+                histogram[luma[l]]++;
+    }
+}
+
+/* Output row oy within the target, from RGB in output order starting at the target's left */
+static void outputRow(const VicSoftware::Job &job, Scratch &scratch, unsigned int oy,
+                      const float *const rgb[3], unsigned int pair_row, uint32_t *histogram) {
+    const Plane &plane = job.out_planes[0];
+    unsigned int x0 = job.target.x, n = job.target.width;
+    uint8_t *tmp = scratch.bytes.data();
+
+    if (isYuv(job.out_fourcc)) {
+        /* U and V are stored from the even column at or before x0 */
+        uint8_t *out = beginRow(plane, x0, x0 + n, oy, tmp, false);
+        packLuma(job.out_transform, rgb, n, out, scratch.uv[pair_row][0].data() + x0 % 2,
+                 scratch.uv[pair_row][1].data() + x0 % 2, histogram);
+        storeRow(plane, x0, x0 + n, oy, out);
+        return;
+    }
+
+    unsigned int bpp = job.out_fourcc == DRM_FORMAT_RGB565 ? 2 : 4;
+    uint8_t *out = beginRow(plane, x0 * bpp, (x0 + n) * bpp, oy, tmp, false);
+
+    switch (job.out_fourcc) {
+    case DRM_FORMAT_ARGB8888:
+        packRgb<DRM_FORMAT_ARGB8888>(rgb, n, out, histogram);
+        break;
+    case DRM_FORMAT_XBGR8888:
+        packRgb<DRM_FORMAT_XBGR8888>(rgb, n, out, histogram);
+        break;
+    case DRM_FORMAT_RGB565:
+        packRgb<DRM_FORMAT_RGB565>(rgb, n, out, histogram);
+        break;
+    }
+
+    storeRow(plane, x0 * bpp, (x0 + n) * bpp, oy, out);
+}
+
+/*
+ * 4:2:0 chroma of output rows y and y + 1, y being even, averaged over the
+ * pixels of each 2x2 block that are in the target. Blocks the target only
+ * partly covers keep the share of the existing chroma belonging to their
+ * other pixels, pixels past the edges of the surface not counting.
+ */
+static void outputChroma(const VicSoftware::Job &job, Scratch &scratch, unsigned int y) {
+    unsigned int x0 = job.target.x, x1 = job.target.x + job.target.width;
+    unsigned int y0 = job.target.y, y1 = job.target.y + job.target.height;
+    bool in_target[2] = { y >= y0 && y < y1, y + 1 >= y0 && y + 1 < y1 };
+    bool in_surface[2] = { true, y + 1 < job.height };
+    unsigned int cx0 = x0 / 2, cx1 = (x1 + 1) / 2;
+    unsigned int base = x0 & ~1u;
+
+    bool partial = x0 % 2 || (x1 % 2 && x1 < job.width) || !in_target[0] ||
+                   (!in_target[1] && in_surface[1]);
+
+    /* NV12 has U and V interleaved in one plane, the others a plane each */
+    bool nv12 = job.out_fourcc == DRM_FORMAT_NV12;
+    unsigned int num_planes = nv12 ? 1 : 2;
+    unsigned int bpp = nv12 ? 2 : 1;
+
+    for (unsigned int p = 0; p < num_planes; p++) {
+        const Plane &plane = job.out_planes[1 + p];
+        uint8_t *row = beginRow(plane, cx0 * bpp, cx1 * bpp, y / 2, scratch.bytes.data(),
+                                partial);
+
+        for (unsigned int cx = cx0; cx < cx1; cx++) {
+            float sum[2] = { 0.0f, 0.0f };
+            unsigned int n_in = 0, n_out = 0;
+
+            for (unsigned int r = 0; r < 2; r++) {
+                for (unsigned int x = cx * 2; x < cx * 2 + 2; x++) {
+                    if (!in_surface[r] || x >= job.width)
+                        continue;
+
+                    if (!in_target[r] || x < x0 || x >= x1) {
+                        n_out++;
+                        continue;
+                    }
+
+                    sum[0] += scratch.uv[r][0][x - base];
+                    sum[1] += scratch.uv[r][1][x - base];
+                    n_in++;
+                }
+            }
+
+            uint8_t *out = row + (cx - cx0) * bpp;
+            for (unsigned int c = 0; c < bpp; c++) {
+                float value = sum[nv12 ? c : p];
+
+                if (n_out)
+                    value += out[c] * (1.0f / 255.0f) * n_out;
+
+                out[c] = toByte(value / (n_in + n_out));
+            }
+        }
+
+        storeRow(plane, cx0 * bpp, cx1 * bpp, y / 2, row);
+    }
+}
+
+/*
+ * Output rows first..last-1, first being even. Rows are handled in pairs so
+ * 4:2:0 chroma can be averaged over 2x2 pixels.
+ */
+static void runBand(VicSoftware::Job &job, Scratch &scratch, unsigned int first,
+                    unsigned int last) {
+    bool yuv = isYuv(job.out_fourcc);
+    uint32_t histogram[VicDevice::HISTOGRAM_BINS] = {0};
+    uint32_t *counts = job.histogram ? histogram : nullptr;
+
+    unsigned int x0 = job.target.x, n = job.target.width;
+    unsigned int row_first = std::max(first, job.target.y);
+    unsigned int row_last = std::min(last, job.target.y + job.target.height);
+    if (row_first >= row_last)
+        return;
+
+    float *tile[3], *row[3];
+    for (unsigned int c = 0; c < 3; c++) {
+        tile[c] = scratch.tile[c].data();
+        row[c] = scratch.row[c].data();
+    }
+
+    /*
+     * Transposed, output rows are composition columns, so the whole band is
+     * composited first, one composition row per output column
+     */
+    unsigned int span = job.flip_y ? job.height - row_last : row_first;
+    if (job.transpose) {
+        for (unsigned int i = 0; i < n; i++) {
+            unsigned int ox = x0 + i;
+            unsigned int cy = job.flip_x ? job.width - 1 - ox : ox;
+            float *out[3] = { tile[0] + i * TILE_STRIDE, tile[1] + i * TILE_STRIDE,
+                              tile[2] + i * TILE_STRIDE };
+
+            composeSpan(job, scratch, cy, span, span + (row_last - row_first), out);
+        }
+    }
+
+    for (unsigned int y = first; y < last; y += 2) {
+        bool any = false;
+
+        for (unsigned int r = 0; r < 2; r++) {
+            unsigned int oy = y + r;
+            if (oy < row_first || oy >= row_last)
+                continue;
+
+            /* Back from the output orientation, a composition column when transposed */
+            const float *rgb[3] = { tile[0], tile[1], tile[2] };
+            unsigned int cy = job.flip_y ? job.height - 1 - oy : oy;
+
+            if (job.transpose) {
+                unsigned int col = cy - span;
+
+                for (unsigned int c = 0; c < 3; c++) {
+                    for (unsigned int i = 0; i < n; i++)
+                        row[c][i] = tile[c][i * TILE_STRIDE + col];
+                    rgb[c] = row[c];
+                }
+            } else {
+                unsigned int cx = job.flip_x ? job.width - x0 - n : x0;
+
+                composeSpan(job, scratch, cy, cx, cx + n, tile);
+
+                if (job.flip_x) {
+                    for (unsigned int c = 0; c < 3; c++) {
+                        std::reverse_copy(tile[c], tile[c] + n, row[c]);
+                        rgb[c] = row[c];
+                    }
+                }
+            }
+
+            outputRow(job, scratch, oy, rgb, r, counts);
+            any = true;
+        }
+
+        if (yuv && any)
+            outputChroma(job, scratch, y);
+    }
+
+    if (job.histogram) {
+        std::lock_guard<std::mutex> lock(job.histogram_lock);
+        for (size_t i = 0; i < VicDevice::HISTOGRAM_BINS; i++)
+            job.histogram[i] += histogram[i];
+    }
+}
+
+static void runBands(VicSoftware::Job &job, Scratch &scratch) {
+    for (;;) {
+        unsigned int band = job.next_band++;
+        if (band >= job.num_bands)
+            return;
+
+        unsigned int first = band * VicSoftware::BAND_ROWS;
+        unsigned int last = std::min(first + VicSoftware::BAND_ROWS, job.height);
+        runBand(job, scratch, first, last);
+    }
+}
+
+static int prepareSlot(const VicOp &op, unsigned int idx, Slot *s) {
+    const VicOp::Surface &in = op.input(idx);
+    const VicOp::Deinterlace &deinterlace = op.deinterlace(idx);
+    VicOp::ColorSpace cs = op.colorSpace(idx);
+    int err;
+
+    err = mapSurface(in, s->planes);
+    if (err)
+        return err;
+
+    s->fourcc = in.fourcc;
+    s->dst = op.composedDestRect(idx);
+    s->nearest = op.filter() == VicFilter::Nearest;
+
+    /* Motion-adaptive deinterlacing falls back to bob, as VIC does without history */
+    s->bob = deinterlace.mode == VicDeinterlace::Bob ||
+             deinterlace.mode == VicDeinterlace::MotionAdaptive;
+    s->field = deinterlace.bottom_field;
+
+    VicOp::Rect src = op.sourceRect(idx);
+    if (src.empty())
+        src = VicOp::Rect(in.x, in.y, in.width - in.x, in.height - in.y);
+
+    float rows_scale = s->bob ? 0.5f : 1.0f;
+    s->min_x = src.x;
+    s->max_x = src.x + src.width - 1;
+    s->min_y = src.y * rows_scale;
+    s->max_y = (src.y + src.height) * rows_scale - 1;
+
+    float step_x = (float)src.width / s->dst.width;
+    float origin_x = src.x + (0.5f - s->dst.x) * step_x;
+    s->step_y = (float)src.height * rows_scale / s->dst.height;
+    s->origin_y = src.y * rows_scale + (0.5f - s->dst.y) * s->step_y;
+
+    /* Columns map the same way on every row, so they are only worked out once */
+    s->col0.resize(s->dst.width);
+    s->col1.resize(s->dst.width);
+    s->col_weight.resize(s->dst.width);
+
+    for (unsigned int i = 0; i < s->dst.width; i++) {
+        float x = origin_x + (s->dst.x + i) * step_x;
+
+        if (s->nearest) {
+            s->col0[i] = s->col1[i] = std::min(std::max((int)floorf(x), s->min_x), s->max_x);
+            s->col_weight[i] = 0.0f;
+            continue;
+        }
+
+        x -= 0.5f;
+        float fx = floorf(x);
+        s->col0[i] = std::min(std::max((int)fx, s->min_x), s->max_x);
+        s->col1[i] = std::min(std::max((int)fx + 1, s->min_x), s->max_x);
+        s->col_weight[i] = x - fx;
+    }
+
+    const VicOp::Blend &blend = op.blend(idx);
+    s->blend = blend.enabled;
+    s->pixel_alpha = in.fourcc == DRM_FORMAT_ARGB8888;
+    s->premultiplied = blend.premultiplied;
+    s->global_alpha = std::max(0.0f, std::min(blend.global_alpha, 1.0f));
+
+    /* RGB surfaces are taken to be sRGB, and composited in the output primaries */
+    const VicOp::ColorSpace &out_cs = op.outputColorSpace();
+    VicColorStandard from = isYuv(in.fourcc) ? cs.standard : VicColorStandard::BT709;
+    VicColorStandard to = isYuv(op.output().fourcc) ? out_cs.standard : VicColorStandard::BT709;
+
+    float csc[12], gamut[12], m[12];
+    if (isYuv(in.fourcc))
+        vicCscMatrix(cs.standard, cs.range, VicCscDirection::YuvToRgb, csc);
+    else
+        memcpy(csc, identity_matrix, sizeof(csc));
+
+    vicGamutMatrix(from, to, gamut);
+    multiply(gamut, csc, m);
+    s->transform = toTransform(m);
+
+    return 0;
+}
+
+static int prepareJob(const VicOp &op, VicSoftware::Job *job) {
+    const VicOp::Surface &out = op.output();
+    int err;
+
+    if (!out.bo || out.width == 0 || out.height == 0)
+        return 1;
+
+    err = mapSurface(out, job->out_planes);
+    if (err)
+        return err;
+
+    job->out_fourcc = out.fourcc;
+    job->width = out.width;
+    job->height = out.height;
+    job->flip_x = op.flipX();
+    job->flip_y = op.flipY();
+    job->transpose = op.transpose();
+    job->clear[0] = op.clearR();
+    job->clear[1] = op.clearG();
+    job->clear[2] = op.clearB();
+
+    job->target = op.targetRect();
+    if (job->target.empty())
+        job->target = VicOp::Rect(0, 0, out.width, out.height);
+
+    job->num_slots = 0;
+    for (unsigned int i = 0; i < VicOp::MAX_SLOTS; i++) {
+        if (!op.input(i).bo)
+            continue;
+
+        Slot &s = job->slots[job->num_slots];
+        err = prepareSlot(op, i, &s);
+        if (err)
+            return err;
+
+        if (!s.dst.empty())
+            job->num_slots++;
+    }
+
+    /*
+     * Vectors keep their capacity, so this only allocates when the target or
+     * the sources get wider. Everything has room for the writes of a last
+     * partial group of four pixels.
+     */
+    unsigned int width = job->target.width;
+    unsigned int src_width = 0;
+    for (unsigned int i = 0; i < job->num_slots; i++) {
+        const Slot &s = job->slots[i];
+        src_width = std::max(src_width, (unsigned int)(s.max_x - s.min_x + 1));
+    }
+
+    size_t tile_size = job->transpose ? (size_t)width * TILE_STRIDE : width + 8;
+    size_t bytes = std::max(width, src_width + 2) * 4 + 64;
+
+    for (Scratch &scratch : job->scratch) {
+        for (unsigned int c = 0; c < 3; c++) {
+            scratch.tile[c].resize(tile_size);
+            scratch.row[c].resize(width + 8);
+        }
+        for (unsigned int r = 0; r < 2; r++) {
+            scratch.uv[r][0].resize(width + 9);
+            scratch.uv[r][1].resize(width + 9);
+            for (unsigned int c = 0; c < 4; c++)
+                scratch.src[r][c].resize(src_width + 8);
+        }
+        scratch.bytes.resize(bytes);
+    }
+
+    if (isYuv(out.fourcc)) {
+        const VicOp::ColorSpace &cs = op.outputColorSpace();
+        float m[12];
+
+        vicCscMatrix(cs.standard, cs.range, VicCscDirection::RgbToYuv, m);
+        job->out_transform = toTransform(m);
+    }
+
+    job->histogram = nullptr;
+    if (op.histogram()) {
+        job->histogram = (uint32_t *)op.histogram()->map();
+        if (!job->histogram)
+            return 1;
+        memset(job->histogram, 0, VicDevice::HISTOGRAM_SIZE);
+    }
+
+    job->num_bands = (out.height + VicSoftware::BAND_ROWS - 1) / VicSoftware::BAND_ROWS;
+    job->next_band = 0;
+
+    return 0;
+}
+
+VicSoftware::VicSoftware()
+: _job(new Job()), _generation(0), _active(0), _quit(false)
+{
+    /* The calling thread works on bands too */
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    _job->scratch.resize(threads);
+    for (unsigned int i = 1; i < threads; i++)
+        _workers.emplace_back(&VicSoftware::worker, this, i);
+}
+
+VicSoftware::~VicSoftware() {
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _quit = true;
+    }
+    _start.notify_all();
+
+    for (auto &thread : _workers)
+        thread.join();
+}
+
+void VicSoftware::worker(unsigned int index)
+{
+    /* Workers start before the first job, at generation 0 */
+    std::unique_lock<std::mutex> lock(_lock);
+    uint32_t seen = 0;
+
+    for (;;) {
+        _start.wait(lock, [&] { return _quit || _generation != seen; });
+        if (_quit)
+            return;
+
+        seen = _generation;
+
+        lock.unlock();
+        runBands(*_job, _job->scratch[index]);
+        lock.lock();
+
+        if (--_active == 0)
+            _done.notify_one();
+    }
+}
+
+int VicSoftware::run(const VicOp *ops, size_t count)
+{
+    int err;
+
+    for (size_t i = 0; i < count; i++) {
+        /* Workers are idle between runs, so the job can be prepared in place */
+        err = prepareJob(ops[i], _job.get());
+        if (err)
+            return err;
+
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _active = _workers.size();
+            _generation++;
+        }
+        _start.notify_all();
+
+        runBands(*_job, _job->scratch[0]);
+
+        std::unique_lock<std::mutex> lock(_lock);
+        _done.wait(lock, [&] { return _active == 0; });
+    }
+
+    return 0;
+}
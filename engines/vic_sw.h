@@ -0,0 +1,70 @@
+/* kate: replace-tabs true; indent-width 4
+ *
+ * Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef VIC_SW_H
+#define VIC_SW_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class VicOp;
+
+/*
+ * CPU implementation of VicOp, used when the VIC engine is not available.
+ * Output rows are split in bands shared between the calling thread and a
+ * pool of workers.
+ */
+class VicSoftware {
+public:
+    VicSoftware();
+    VicSoftware(const VicSoftware &) = delete;
+    ~VicSoftware();
+
+    // Runs ops one after the other, returning once all outputs are written. Scratch
+    // storage only grows, so repeating the same ops does not allocate
+    int run(const VicOp *ops, size_t count);
+
+    // Output rows taken by a worker at a time, even so 4:2:0 chroma rows are not split
+    static constexpr unsigned int BAND_ROWS = 16;
+
+    struct Job;
+
+private:
+    std::vector<std::thread> _workers;
+    std::mutex _lock;
+    std::condition_variable _start, _done;
+    // Reused by every run, with scratch storage for each thread
+    std::unique_ptr<Job> _job;
+    uint32_t _generation;
+    unsigned int _active;
+    bool _quit;
+
+    void worker(unsigned int index);
+};
+
+#endif // VIC_SW_H
@@ -171,8 +171,33 @@ int DrmDevice::waitSyncpoint(uint32_t id, uint32_t threshold) {
     // printf("Syncpoint wait %u:%u timed out\n", id, threshold);
 }
 
+void DrmDevice::refHandle(gem_handle handle)
+{
+    std::lock_guard<std::mutex> g(_handles_lock);
+
+    _handle_refs[handle]++;
+}
+
+void DrmDevice::unrefHandle(gem_handle handle)
+{
+    std::lock_guard<std::mutex> g(_handles_lock);
+
+    auto it = _handle_refs.find(handle);
+    if (it == _handle_refs.end() || --it->second > 0)
+        return;
+
+    _handle_refs.erase(it);
+
+    struct drm_gem_close close_args;
+    memset(&close_args, 0, sizeof(close_args));
+
+    close_args.handle = handle;
+
+    ioctl(DRM_IOCTL_GEM_CLOSE, &close_args);
+}
+
 GemBuffer::GemBuffer(DrmDevice &dev)
-: _dev(dev), _valid(false), _handle(0), _map(nullptr)
+: _dev(dev), _valid(false), _handle(0), _map(nullptr), _dmabuf_fds{ -1, -1 }
 {
 }
 
@@ -189,14 +214,12 @@ GemBuffer::~GemBuffer()
         munmap(_map, _size);
     }
 
-    if (_valid) {
-        struct drm_gem_close close_args;
-        memset(&close_args, 0, sizeof(close_args));
-
-        close_args.handle = _handle;
+    for (int32_t fd : _dmabuf_fds)
+        if (fd != -1)
+            close(fd);
 
-        _dev.ioctl(DRM_IOCTL_GEM_CLOSE, &close_args);
-    }
+    if (_valid)
+        _dev.unrefHandle(_handle);
 }
 
 int GemBuffer::channelMap(uint32_t channel_ctx, bool readwrite)
@@ -240,6 +263,8 @@ int GemBuffer::allocate(size_t bytes)
     _size = bytes;
     _valid = true;
 
+    _dev.refHandle(_handle);
+
     return 0;
 }
 
@@ -261,6 +286,40 @@ int GemBuffer::openByName(uint32_t name)
 
     _valid = true;
 
+    _dev.refHandle(_handle);
+
+    return 0;
+}
+
+int GemBuffer::importFd(int fd)
+{
+    struct drm_prime_handle args;
+    off_t size;
+    int err;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size == -1) {
+        perror("DMA-BUF size query failed");
+        return -1;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.fd = fd;
+
+    err = _dev.ioctl(DRM_IOCTL_PRIME_FD_TO_HANDLE, &args);
+    if (err == -1) {
+        perror("GEM import failed");
+        return err;
+    }
+
+    /* May be the handle of a buffer that is already open, see DrmDevice::refHandle() */
+    _handle = args.handle;
+    _size = size;
+
+    _valid = true;
+
+    _dev.refHandle(_handle);
+
     return 0;
 }
 
@@ -297,18 +356,28 @@ void * GemBuffer::map()
 int32_t GemBuffer::exportFd(bool readwrite)
 {
     struct drm_prime_handle args;
+    int32_t &dmabuf_fd = _dmabuf_fds[readwrite];
+    int32_t fd;
     int err;
 
-    memset(&args, 0, sizeof(args));
+    if (dmabuf_fd == -1) {
+        memset(&args, 0, sizeof(args));
 
-    args.handle = _handle;
-    args.flags = readwrite ? DRM_RDWR : 0;
+        args.handle = _handle;
+        args.flags = readwrite ? DRM_RDWR : 0;
 
-    err = _dev.ioctl(DRM_IOCTL_PRIME_HANDLE_TO_FD, &args);
-    if (err == -1) {
-        perror("GEM export failed");
-        return -1;
+        err = _dev.ioctl(DRM_IOCTL_PRIME_HANDLE_TO_FD, &args);
+        if (err == -1) {
+            perror("GEM export failed");
+            return -1;
+        }
+
+        dmabuf_fd = args.fd;
     }
 
-    return args.fd;
+    fd = dup(dmabuf_fd);
+    if (fd == -1)
+        perror("DMA-BUF dup failed");
+
+    return fd;
 }
@@ -27,9 +27,12 @@
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <mutex>
 
 #include <libdrm/drm.h>
 
+typedef uint32_t gem_handle;
+
 class DrmDevice {
 public:
     DrmDevice();
@@ -49,12 +52,21 @@ public:
 
     int waitSyncpoint(uint32_t id, uint32_t threshold);
 
+    /*
+     * GEM handles are per file, and importing a DMA-BUF that is already
+     * known to it returns the existing handle. Every GemBuffer holds a
+     * reference, and the handle is closed when the last one goes away.
+     */
+    void refHandle(gem_handle handle);
+    void unrefHandle(gem_handle handle);
+
 private:
     int _fd;
     bool _new_api;
-};
 
-typedef uint32_t gem_handle;
+    std::mutex _handles_lock;
+    std::map<gem_handle, unsigned int> _handle_refs;
+};
 
 class GemBuffer {
 public:
@@ -64,8 +76,12 @@ public:
 
     int allocate(size_t bytes);
     int openByName(uint32_t name);
+    // Imports a DMA-BUF, the fd stays owned by the caller
+    int importFd(int fd);
     void *map();
     int channelMap(uint32_t channel_ctx, bool readwrite);
+    // Returns a new fd owned by the caller, duplicated from a DMA-BUF exported once per mode.
+    // The cached DMA-BUFs are closed with the buffer, for surfaces in vaDestroySurfaces()
     int32_t exportFd(bool readwrite);
 
     gem_handle handle() const { return _handle; }
@@ -81,6 +97,9 @@ private:
 
     void *_map;
 
+    // Cached read-only and read-write exports
+    int32_t _dmabuf_fds[2];
+
     std::map<uint32_t, uint32_t> _mapping_ids;
 };
 
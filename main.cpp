@@ -21,9 +21,13 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
+#include <iterator>
+#include <utility>
 
 #include <libdrm/drm_fourcc.h>
 #include <linux/kernel.h>
@@ -33,6 +37,7 @@
 #include "context.h"
 #include "gem.h"
 #include "objects.h"
+#include "va_tegra.h"
 
 #include "engines/vic.h"
 
@@ -44,16 +49,152 @@ extern "C" {
 
 #define DRIVER_DATA ((DriverData *)ctx->pDriverData)
 
+/* DRI2 buffers of drawables, kept open and mapped to VIC between vaPutSurface() calls */
+struct DrawableBuffer {
+    Drawable drawable;
+    uint32_t name;
+    unsigned int width, height;
+    uint32_t last_use;
+    std::unique_ptr<GemBuffer> gem;
+};
+
+static constexpr size_t DRAWABLE_BUFFER_CACHE_SIZE = 8;
+
 struct DriverData {
     Objects objects;
     DrmDevice *drm;
     VicDevice *vic;
     NvdecDevice *nvdec;
+
+    std::array<DrawableBuffer, DRAWABLE_BUFFER_CACHE_SIZE> drawable_buffers;
+    uint32_t drawable_clock;
+};
+
+/* Image formats VIC converts to and from in GetImage/PutImage */
+struct ImageFormat {
+    VAImageFormat va;
+    uint32_t drm_fourcc;
+    // Bytes per pixel of the first plane
+    unsigned int cpp;
+};
+
+static const ImageFormat image_formats[] = {
+    { { VA_FOURCC_NV12, VA_LSB_FIRST, 12 }, DRM_FORMAT_NV12, 1 },
+    { { VA_FOURCC_I420, VA_LSB_FIRST, 12 }, DRM_FORMAT_YUV420, 1 },
+    { { VA_FOURCC_YV12, VA_LSB_FIRST, 12 }, DRM_FORMAT_YVU420, 1 },
+    { { VA_FOURCC_BGRA, VA_LSB_FIRST, 32, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000 },
+      DRM_FORMAT_ARGB8888, 4 },
+    { { VA_FOURCC_RGBX, VA_LSB_FIRST, 32, 24, 0x000000ff, 0x0000ff00, 0x00ff0000, 0 },
+      DRM_FORMAT_XBGR8888, 4 },
+    { { VA_FOURCC_RGB565, VA_LSB_FIRST, 16, 16, 0xf800, 0x07e0, 0x001f, 0 },
+      DRM_FORMAT_RGB565, 2 },
 };
 
+static const ImageFormat *imageFormat(uint32_t fourcc)
+{
+    for (const ImageFormat &format : image_formats)
+        if (format.va.fourcc == fourcc)
+            return &format;
+
+    return nullptr;
+}
+
+/* Surface formats; RGB surfaces are created with VA_RT_FORMAT_RGB32 for VIC output */
+static const uint32_t surface_formats[] = {
+    VA_FOURCC_NV12,
+    VA_FOURCC_BGRA,
+    VA_FOURCC_RGBX,
+};
+
+/*
+ * Decoded surfaces are NV12, by default in the NVDEC 16Bx2 two-GOB block
+ * linear layout. RGB surfaces only receive VIC output and are linear.
+ */
+static VicOp::Surface vicSurface(VADriverContextP ctx, Surface *surface)
+{
+    VicOp::Surface op_surface;
+    const ImageFormat *format = imageFormat(surface->format);
+
+    op_surface.bo = DRIVER_DATA->objects.buffer(surface->buffer)->gem.get();
+    op_surface.width = surface->width;
+    op_surface.height = surface->height;
+    op_surface.pitch = surface->pitch / format->cpp;
+    op_surface.fourcc = format->drm_fourcc;
+    op_surface.format = surface->modifier;
+
+    return op_surface;
+}
+
+/* Buffer NVDEC decodes into and takes references from, always block linear */
+static GemBuffer *decodeBuffer(VADriverContextP ctx, Surface *surface)
+{
+    if (surface->tiled_buffer != VA_INVALID_ID)
+        return DRIVER_DATA->objects.buffer(surface->tiled_buffer)->gem.get();
+
+    return DRIVER_DATA->objects.buffer(surface->buffer)->gem.get();
+}
+
+/* Images are linear, with the layout given in their VAImage description */
+static VicOp::Surface vicImage(Image *image)
+{
+    VicOp::Surface op_surface;
+    const ImageFormat *format = imageFormat(image->desc.format.fourcc);
+
+    op_surface.bo = image->buffer->gem.get();
+    op_surface.width = image->desc.width;
+    op_surface.height = image->desc.height;
+    op_surface.pitch = image->desc.pitches[0] / format->cpp;
+    op_surface.fourcc = format->drm_fourcc;
+    op_surface.format = DRM_FORMAT_MOD_LINEAR;
+
+    return op_surface;
+}
+
+static VicFilter vicFilter(uint32_t flags)
+{
+    switch (flags & VA_FILTER_SCALING_MASK) {
+    case VA_FILTER_SCALING_FAST:
+        return VicFilter::Bilinear;
+    case VA_FILTER_SCALING_HQ:
+        return VicFilter::Lanczos;
+    default:
+        return VicFilter::Bicubic;
+    }
+}
+
+static VicColorStandard vicColorStandard(VAProcColorStandardType standard)
+{
+    switch (standard) {
+    case VAProcColorStandardBT709:
+    case VAProcColorStandardXVYCC709:
+    case VAProcColorStandardSRGB:
+        return VicColorStandard::BT709;
+    case VAProcColorStandardBT2020:
+        return VicColorStandard::BT2020;
+    default:
+        return VicColorStandard::BT601;
+    }
+}
+
+static VicColorRange vicColorRange(uint8_t range)
+{
+    return range == VA_SOURCE_RANGE_FULL ? VicColorRange::Full : VicColorRange::Limited;
+}
+
+/* PutSurface gives the matrix of the source as flags, SMPTE 240M being close to BT.709 */
+static VicColorStandard vicSourceStandard(uint32_t flags)
+{
+    if (flags & (VA_SRC_BT709 | VA_SRC_SMPTE_240))
+        return VicColorStandard::BT709;
+
+    return VicColorStandard::BT601;
+}
+
 FUNC(Terminate)
 {
     DRIVER_DATA->objects.clear();
+    for (DrawableBuffer &entry : DRIVER_DATA->drawable_buffers)
+        entry.gem.reset();
     delete DRIVER_DATA->nvdec;
     delete DRIVER_DATA->vic;
     delete DRIVER_DATA->drm;
@@ -73,6 +214,7 @@ FUNC(QueryConfigProfiles, VAProfile *profile_list, int *num_profiles)
     profile_list[num++] = VAProfileH264ConstrainedBaseline;
     profile_list[num++] = VAProfileH264Main;
     profile_list[num++] = VAProfileH264High;
+    profile_list[num++] = VAProfileNone;
 
     *num_profiles = num;
 
@@ -92,6 +234,13 @@ FUNC(QueryConfigEntrypoints, VAProfile profile, VAEntrypoint *entrypoint_list, i
 
         break;
 
+    case VAProfileNone:
+        entrypoint_list[0] = VAEntrypointVideoProc;
+
+        *num_entrypoints = 1;
+
+        break;
+
     default:
         *num_entrypoints = 0;
     }
@@ -104,17 +253,28 @@ FUNC(GetConfigAttributes, VAProfile profile, VAEntrypoint entrypoint, VAConfigAt
 {
     int i;
 
-    if (profile != VAProfileMPEG2Main && profile != VAProfileH264Main &&
-        profile != VAProfileH264ConstrainedBaseline && profile != VAProfileH264High)
-        return VA_STATUS_ERROR_INVALID_VALUE;
+    if (profile == VAProfileNone) {
+        if (entrypoint != VAEntrypointVideoProc)
+            return VA_STATUS_ERROR_INVALID_VALUE;
+    } else {
+        if (profile != VAProfileMPEG2Main && profile != VAProfileH264Main &&
+            profile != VAProfileH264ConstrainedBaseline && profile != VAProfileH264High)
+            return VA_STATUS_ERROR_INVALID_VALUE;
 
-    if (entrypoint != VAEntrypointVLD)
-        return VA_STATUS_ERROR_INVALID_VALUE;
+        if (entrypoint != VAEntrypointVLD)
+            return VA_STATUS_ERROR_INVALID_VALUE;
+    }
 
     for (i = 0; i < num_attribs; i++) {
         switch (attrib_list[i].type) {
         case VAConfigAttribRTFormat:
-            attrib_list[i].value = VA_RT_FORMAT_YUV420;
+            attrib_list[i].value = VA_RT_FORMAT_YUV420 | VA_RT_FORMAT_RGB32;
+            break;
+        case VAConfigAttribDecProcessing:
+            if (entrypoint == VAEntrypointVLD)
+                attrib_list[i].value = VA_DEC_PROCESSING;
+            else
+                attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
             break;
         default:
             attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
@@ -126,10 +286,20 @@ FUNC(GetConfigAttributes, VAProfile profile, VAEntrypoint entrypoint, VAConfigAt
 
 const VAConfigID CONFIG_MPEG2 = 1001;
 const VAConfigID CONFIG_H264 = 1002;
+const VAConfigID CONFIG_VPP = 1003;
 
 FUNC(CreateConfig, VAProfile profile, VAEntrypoint entrypoint, VAConfigAttrib *attrib_list,
     int num_attribs, VAConfigID *config_id)
 {
+    if (entrypoint == VAEntrypointVideoProc) {
+        if (profile != VAProfileNone)
+            return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+
+        *config_id = CONFIG_VPP;
+
+        return VA_STATUS_SUCCESS;
+    }
+
     if (entrypoint != VAEntrypointVLD)
         return VA_STATUS_ERROR_INVALID_VALUE;
 
@@ -160,41 +330,237 @@ FUNC(QueryConfigAttributes, VAConfigID config_id, VAProfile *profile, VAEntrypoi
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
-/* TODO destroy already created surfaces on error */
+/* Layout of external DMA-BUFs imported as surfaces, one fd per surface */
+struct SurfaceImport {
+    uint32_t fourcc;
+    uint64_t modifier;
+    // Byte pitches and offsets of the luma plane and, for NV12, the chroma plane
+    uint32_t pitches[2];
+    uint32_t offsets[2];
+    std::vector<int> fds;
+};
+
+static VAStatus surfaceImport(uint32_t memory_type, void *descriptor, unsigned int num_surfaces,
+    SurfaceImport *import)
+{
+    if (!descriptor)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    switch (memory_type) {
+    case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME: {
+        auto *buffers = (VASurfaceAttribExternalBuffers *)descriptor;
+        if (buffers->num_buffers < num_surfaces)
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+        import->fourcc = buffers->pixel_format;
+        import->modifier = DRM_FORMAT_MOD_LINEAR;
+        import->pitches[0] = buffers->pitches[0];
+        import->pitches[1] = buffers->num_planes > 1 ? buffers->pitches[1] : buffers->pitches[0];
+        import->offsets[0] = buffers->offsets[0];
+        import->offsets[1] = buffers->offsets[1];
+        import->fds.assign(buffers->buffers, buffers->buffers + num_surfaces);
+        break;
+    }
+    case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2: {
+        auto *desc = (VADRMPRIMESurfaceDescriptor *)descriptor;
+
+        /* All planes have to be in the same buffer, which describes a single surface */
+        if (num_surfaces != 1 || desc->num_objects != 1)
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+        import->fourcc = desc->fourcc;
+        import->modifier = desc->objects[0].drm_format_modifier;
+        import->pitches[0] = desc->layers[0].pitch[0];
+        import->offsets[0] = desc->layers[0].offset[0];
+        // Chroma is either a layer of its own or the second plane of a composed layer
+        if (desc->num_layers > 1) {
+            import->pitches[1] = desc->layers[1].pitch[0];
+            import->offsets[1] = desc->layers[1].offset[0];
+        } else {
+            import->pitches[1] = desc->layers[0].num_planes > 1 ? desc->layers[0].pitch[1]
+                                                                : desc->layers[0].pitch[0];
+            import->offsets[1] = desc->layers[0].offset[1];
+        }
+        import->fds.assign(1, desc->objects[0].fd);
+        break;
+    }
+    default:
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Drops a surface object along with its buffers and subpicture associations.
+ * Deleting the buffers also closes the DMA-BUFs cached for exports.
+ */
+static void destroySurface(VADriverContextP ctx, VASurfaceID id)
+{
+    Surface *surface = DRIVER_DATA->objects.surface(id);
+    if (!surface)
+        return;
+
+    for (const SubpictureAssociation &assoc : surface->subpictures) {
+        Subpicture *subpicture = DRIVER_DATA->objects.subpicture(assoc.subpicture);
+        if (!subpicture)
+            continue;
+
+        auto &list = subpicture->surfaces;
+        list.erase(std::remove(list.begin(), list.end(), id), list.end());
+    }
+
+    DRIVER_DATA->objects.destroy(surface->buffer);
+    if (surface->tiled_buffer != VA_INVALID_ID)
+        DRIVER_DATA->objects.destroy(surface->tiled_buffer);
+    DRIVER_DATA->objects.destroy(id);
+}
+
 FUNC(CreateSurfaces2, unsigned int format, unsigned int width, unsigned int height,
     VASurfaceID *surfaces, unsigned int num_surfaces, VASurfaceAttrib *attrib_list,
     unsigned int num_attribs)
 {
-    int i, err;
+    int i;
     unsigned padded_height = __ALIGN_KERNEL(height, 16);
+    uint32_t fourcc;
+    uint64_t modifier = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB;
+    uint32_t memory_type = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    void *descriptor = nullptr;
+    SurfaceImport import;
+
+    switch (format) {
+    case VA_RT_FORMAT_YUV420:
+        fourcc = VA_FOURCC_NV12;
+        break;
+    case VA_RT_FORMAT_RGB32:
+        fourcc = VA_FOURCC_BGRA;
+        break;
+    default:
+        return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+    }
+
+    for (i = 0; i < (int)num_attribs; i++) {
+        switch (attrib_list[i].type) {
+        case VASurfaceAttribPixelFormat:
+            fourcc = attrib_list[i].value.value.i;
+            break;
+        case VASurfaceAttribMemoryType:
+            memory_type = attrib_list[i].value.value.i;
+            break;
+        case VASurfaceAttribExternalBufferDescriptor:
+            descriptor = attrib_list[i].value.value.p;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (memory_type != VA_SURFACE_ATTRIB_MEM_TYPE_VA) {
+        VAStatus status = surfaceImport(memory_type, descriptor, num_surfaces, &import);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+
+        fourcc = import.fourcc;
+    }
+
+    if (std::find(std::begin(surface_formats), std::end(surface_formats), fourcc) ==
+            std::end(surface_formats) ||
+        (fourcc != VA_FOURCC_NV12) != (format == VA_RT_FORMAT_RGB32))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    if (fourcc != VA_FOURCC_NV12)
+        modifier = DRM_FORMAT_MOD_LINEAR;
+
+#if VA_CHECK_VERSION(1, 14, 0)
+    /* Linear NV12 surfaces are for consumers that can't take block linear */
+    for (i = 0; i < (int)num_attribs; i++) {
+        if (attrib_list[i].type != VASurfaceAttribDRMFormatModifiers)
+            continue;
+
+        auto *list = (const VADRMFormatModifierList *)attrib_list[i].value.value.p;
+        uint64_t *end = list->modifiers + list->num_modifiers;
+
+        if (std::find(list->modifiers, end, modifier) == end) {
+            if (std::find(list->modifiers, end, DRM_FORMAT_MOD_LINEAR) == end)
+                return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+            modifier = DRM_FORMAT_MOD_LINEAR;
+        }
+    }
+#endif
+
+    const ImageFormat *surface_format = imageFormat(fourcc);
+    int pitch = __ALIGN_KERNEL(width * surface_format->cpp, 256);
+
+    /* Imported buffers are used in place, so they must have a layout VIC and NVDEC can take */
+    if (!import.fds.empty()) {
+        modifier = import.modifier;
+
+        /* Both NV12 planes share one pitch in the layouts VIC and NVDEC take */
+        if (import.pitches[0] % 256 || import.pitches[0] < width * surface_format->cpp ||
+            import.offsets[0] != 0 ||
+            (fourcc == VA_FOURCC_NV12 && (import.pitches[1] != import.pitches[0] ||
+                                          import.offsets[1] != import.pitches[0] * padded_height)))
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+        pitch = import.pitches[0];
+    }
+
+    if (modifier != DRM_FORMAT_MOD_LINEAR &&
+        (fourcc != VA_FOURCC_NV12 || modifier != DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    size_t size = pitch * padded_height;
+    if (fourcc == VA_FOURCC_NV12)
+        size += pitch * padded_height / 2;
 
     for (i = 0; i < (int)num_surfaces; ++i) {
-        int pitch = __ALIGN_KERNEL(width, 256);
+        VAStatus status = VA_STATUS_SUCCESS;
+
+        /* Storage comes first, so that only complete surfaces get an object */
+        auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
+        std::unique_ptr<GemBuffer> tiled;
+
+        if (!import.fds.empty()) {
+            if (gem->importFd(import.fds[i]) || gem->size() < size)
+                status = VA_STATUS_ERROR_INVALID_PARAMETER;
+        } else if (gem->allocate(size)) {
+            status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+
+        if (status == VA_STATUS_SUCCESS && fourcc == VA_FOURCC_NV12 &&
+            modifier == DRM_FORMAT_MOD_LINEAR) {
+            tiled = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
+            if (tiled->allocate(size))
+                status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+
+        /* The surfaces created so far are not handed out either */
+        if (status != VA_STATUS_SUCCESS) {
+            while (i-- > 0)
+                destroySurface(ctx, surfaces[i]);
+            return status;
+        }
 
         Surface *surface = DRIVER_DATA->objects.createSurface(&surfaces[i]);
         surface->width = width;
         surface->height = height;
         surface->pitch = pitch;
-
-        size_t size = (pitch * padded_height) + (pitch * padded_height / 2);
-
-        auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
-        err = gem->allocate(size);
-        if (err)
-            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        surface->format = fourcc;
+        surface->modifier = modifier;
 
         Buffer *buffer = DRIVER_DATA->objects.createBuffer(&surface->buffer);
         buffer->has_gem = true;
         buffer->type = VABufferTypeMax;
         buffer->gem = std::move(gem);
 
-        switch (format) {
-        case VA_RT_FORMAT_YUV420:
-            surface->format = VA_FOURCC_NV12;
-            break;
-        default:
-            return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
-        }
+        if (!tiled)
+            continue;
+
+        Buffer *tiled_buffer = DRIVER_DATA->objects.createBuffer(&surface->tiled_buffer);
+        tiled_buffer->has_gem = true;
+        tiled_buffer->type = VABufferTypeMax;
+        tiled_buffer->gem = std::move(tiled);
     }
 
     return VA_STATUS_SUCCESS;
@@ -217,9 +583,14 @@ FUNC(ExportSurfaceHandle, VASurfaceID surface_id, uint32_t mem_type, uint32_t fl
     if (mem_type != VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2)
         return VA_STATUS_ERROR_UNIMPLEMENTED;
 
+    bool composed = (flags & VA_EXPORT_SURFACE_COMPOSED_LAYERS) != 0;
+    if (composed && (flags & VA_EXPORT_SURFACE_SEPARATE_LAYERS))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
     VADRMPRIMESurfaceDescriptor desc;
+    memset(&desc, 0, sizeof(desc));
 
-    desc.fourcc = VA_FOURCC_NV12;
+    desc.fourcc = surface->format;
     desc.width = surface->width;
     desc.height = surface->height;
 
@@ -228,19 +599,33 @@ FUNC(ExportSurfaceHandle, VASurfaceID surface_id, uint32_t mem_type, uint32_t fl
     if (desc.objects[0].fd == -1)
         return VA_STATUS_ERROR_UNKNOWN;
     desc.objects[0].size = buffer->gem->size();
-    desc.objects[0].drm_format_modifier = DRM_FORMAT_NV12;
-
-    desc.num_layers = 2;
-    desc.layers[0].drm_format = DRM_FORMAT_R8;
-    desc.layers[0].num_planes = 1;
-    desc.layers[0].object_index[0] = 0;
-    desc.layers[0].offset[0] = 0;
-    desc.layers[0].pitch[0] = surface->pitch;
-    desc.layers[1].drm_format = DRM_FORMAT_GR88;
-    desc.layers[1].num_planes = 1;
-    desc.layers[1].object_index[0] = 0;
-    desc.layers[1].offset[0] = surface->pitch * __ALIGN_KERNEL(surface->height, 16);
-    desc.layers[1].pitch[0] = surface->pitch;
+    desc.objects[0].drm_format_modifier = surface->modifier;
+
+    uint32_t chroma_offset = surface->pitch * __ALIGN_KERNEL(surface->height, 16);
+
+    if (surface->format != VA_FOURCC_NV12) {
+        desc.num_layers = 1;
+        desc.layers[0].drm_format = imageFormat(surface->format)->drm_fourcc;
+        desc.layers[0].num_planes = 1;
+        desc.layers[0].pitch[0] = surface->pitch;
+    } else if (composed) {
+        /* A single NV12 layer, as EGL and GL importers take it */
+        desc.num_layers = 1;
+        desc.layers[0].drm_format = DRM_FORMAT_NV12;
+        desc.layers[0].num_planes = 2;
+        desc.layers[0].offset[1] = chroma_offset;
+        desc.layers[0].pitch[0] = surface->pitch;
+        desc.layers[0].pitch[1] = surface->pitch;
+    } else {
+        desc.num_layers = 2;
+        desc.layers[0].drm_format = DRM_FORMAT_R8;
+        desc.layers[0].num_planes = 1;
+        desc.layers[0].pitch[0] = surface->pitch;
+        desc.layers[1].drm_format = DRM_FORMAT_GR88;
+        desc.layers[1].num_planes = 1;
+        desc.layers[1].offset[0] = chroma_offset;
+        desc.layers[1].pitch[0] = surface->pitch;
+    }
 
     *(VADRMPRIMESurfaceDescriptor *)descriptor = desc;
 
@@ -249,6 +634,20 @@ FUNC(ExportSurfaceHandle, VASurfaceID surface_id, uint32_t mem_type, uint32_t fl
 
 FUNC(DestroySurfaces, VASurfaceID *surface_list, int num_surfaces)
 {
+    int i;
+
+    /* Nothing is destroyed unless all of the surfaces exist */
+    for (i = 0; i < num_surfaces; i++)
+        if (!DRIVER_DATA->objects.surface(surface_list[i]))
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    /* An asynchronous VIC copy may still be reading or writing them */
+    if (DRIVER_DATA->vic->sync())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    for (i = 0; i < num_surfaces; i++)
+        destroySurface(ctx, surface_list[i]);
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -263,6 +662,11 @@ FUNC(CreateContext, VAConfigID config_id, int picture_width, int picture_height,
         context->op.setCodec(NvdecCodec::MPEG2);
     else if (config_id == CONFIG_H264)
         context->op.setCodec(NvdecCodec::H264);
+    else if (config_id == CONFIG_VPP)
+        context->video_proc = true;
+
+    context->keyframes_only = !context->video_proc && (flag & VA_TEGRA_CONTEXT_KEYFRAMES_ONLY);
+    context->op.setKeyframesOnly(context->keyframes_only);
 
     return VA_STATUS_SUCCESS;
 }
@@ -275,11 +679,40 @@ FUNC(DestroyContext, VAContextID context)
 FUNC(CreateBuffer, VAContextID context, VABufferType type, unsigned int size,
     unsigned int num_elements, void *data, VABufferID *buf_id)
 {
+    std::unique_ptr<GemBuffer> gem;
+
+    /*
+     * Statistics buffers are written by VIC, so they need GEM storage. It is
+     * set up first, so that no buffer object is left behind on failure.
+     */
+    if (type == VAStatsStatisticsBufferType) {
+        gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
+        int err = gem->allocate(__ALIGN_KERNEL(size * num_elements, 256));
+        if (err)
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+        if (data) {
+            void *ptr = gem->map();
+            if (!ptr)
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+
+            memcpy(ptr, data, size * num_elements);
+        }
+    }
+
     Buffer *buffer = DRIVER_DATA->objects.createBuffer(buf_id);
     if (!buffer)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
     buffer->type = type;
+
+    if (gem) {
+        buffer->has_gem = true;
+        buffer->gem = std::move(gem);
+
+        return VA_STATUS_SUCCESS;
+    }
+
     buffer->has_gem = false;
     buffer->data.resize(size * num_elements);
 
@@ -330,16 +763,24 @@ FUNC(BeginPicture, VAContextID context_id, VASurfaceID render_target)
     if (!surface)
         return VA_STATUS_ERROR_INVALID_SURFACE;
 
-    Buffer *surf_buffer = DRIVER_DATA->objects.buffer(surface->buffer);
+    if (context->video_proc) {
+        context->vpp_op = VicOp();
+        context->vpp_op.setOutput(vicSurface(ctx, surface));
+        context->vpp_slots = 0;
+        context->vpp_additional_outputs.clear();
+
+        return VA_STATUS_SUCCESS;
+    }
+
+    if (surface->format != VA_FOURCC_NV12)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
 
     NvdecOp::Surface output_surface;
-    output_surface.bo = surf_buffer->gem.get();
+    output_surface.bo = decodeBuffer(ctx, surface);
     output_surface.width = surface->width;
     output_surface.height = surface->height;
     output_surface.pitch = surface->pitch;
 
-    /* TODO will need temp surface to unswizzle */
-
     if (context->op.codec() == NvdecCodec::MPEG2)
         context->op.mpeg2() = NvdecOp::MPEG2();
     else if (context->op.codec() == NvdecCodec::H264)
@@ -351,6 +792,9 @@ FUNC(BeginPicture, VAContextID context_id, VASurfaceID render_target)
     context->op.setSliceDataOffsets(nullptr);
     context->num_slices = 0;
     context->total_slice_size = 0;
+    context->render_target = render_target;
+    context->intra_picture = true;
+    context->dec_proc_outputs.clear();
 
     return VA_STATUS_SUCCESS;
 }
@@ -361,85 +805,392 @@ const uint8_t termination_sequence_mpeg2[16] = { 0x00, 0x00, 0x01, 0xB7, 0x00, 0
 const uint8_t termination_sequence_h264[16] = { 0x00, 0x00, 0x01, 0x0B, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x01, 0x0B, 0x00, 0x00, 0x00, 0x00 };
 
-FUNC(RenderPicture, VAContextID context_id, VABufferID *buffers, int num_buffers)
+/* VA mirrors the input before rotating it clockwise */
+static VAStatus setOrientation(VicOp &op, uint32_t rotation, uint32_t mirror)
 {
-    int i;
+    bool flip_x = (mirror & VA_MIRROR_HORIZONTAL) != 0;
+    bool flip_y = (mirror & VA_MIRROR_VERTICAL) != 0;
+    bool transpose = false;
 
-    Context *context = DRIVER_DATA->objects.context(context_id);
-    if (!context)
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    switch (rotation) {
+    case VA_ROTATION_NONE:
+        break;
+    case VA_ROTATION_90:
+        transpose = true;
+        std::swap(flip_x, flip_y);
+        flip_x = !flip_x;
+        break;
+    case VA_ROTATION_180:
+        flip_x = !flip_x;
+        flip_y = !flip_y;
+        break;
+    case VA_ROTATION_270:
+        transpose = true;
+        std::swap(flip_x, flip_y);
+        flip_y = !flip_y;
+        break;
+    default:
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
 
-    uint32_t total_slice_size;
+    op.setOrientation(flip_x, flip_y, transpose);
 
-    if (context->op.codec() == NvdecCodec::MPEG2)
-        total_slice_size = sizeof(termination_sequence_mpeg2);
-    else if (context->op.codec() == NvdecCodec::H264)
-        total_slice_size = sizeof(termination_sequence_h264);
-    else
-        return VA_STATUS_ERROR_UNKNOWN;
+    return VA_STATUS_SUCCESS;
+}
 
-    uint32_t num_slices = 0;
-    for (i = 0; i < num_buffers; i++) {
-        Buffer *buffer = DRIVER_DATA->objects.buffer(buffers[i]);
-        if (!buffer)
-            return VA_STATUS_ERROR_INVALID_BUFFER;
+static VAStatus setReferenceSurface(VADriverContextP ctx, VicOp &op, unsigned int slot,
+    VicSlotSurface which, VASurfaceID surface_id)
+{
+    Surface *surface = DRIVER_DATA->objects.surface(surface_id);
+    if (!surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
 
-        if (buffer->type != VASliceParameterBufferType)
-            continue;
+    op.setSlotSurface(slot, which, vicSurface(ctx, surface));
 
-        auto *buff = (VASliceParameterBufferBase *)buffer->data.data();
+    return VA_STATUS_SUCCESS;
+}
 
-        total_slice_size += buff->slice_data_size;
-        if (context->op.codec() == NvdecCodec::H264)
-            total_slice_size += 3;
+static VAStatus setDeinterlacing(VADriverContextP ctx, VicOp &op, unsigned int slot,
+    const VAProcPipelineParameterBuffer *pipeline,
+    const VAProcFilterParameterBufferDeinterlacing *params)
+{
+    VicOp::Deinterlace deinterlace;
 
-        if ((buff->slice_data_flag == VA_SLICE_DATA_FLAG_ALL) ||
-            (buff->slice_data_flag & VA_SLICE_DATA_FLAG_BEGIN))
-            num_slices++;
+    switch (params->algorithm) {
+    case VAProcDeinterlacingBob:
+        deinterlace.mode = VicDeinterlace::Bob;
+        break;
+    case VAProcDeinterlacingWeave:
+        deinterlace.mode = VicDeinterlace::Weave;
+        break;
+    case VAProcDeinterlacingMotionAdaptive:
+    case VAProcDeinterlacingMotionCompensated:
+        deinterlace.mode = VicDeinterlace::MotionAdaptive;
+        break;
+    default:
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
 
-        if (buff->slice_data_flag != VA_SLICE_DATA_FLAG_ALL) {
-            printf("Partial slice!!\n");
-        }
+    deinterlace.bottom_field = (params->flags & VA_DEINTERLACING_BOTTOM_FIELD) != 0;
+    deinterlace.bottom_field_first = (params->flags & VA_DEINTERLACING_BOTTOM_FIELD_FIRST) != 0;
+
+    op.setDeinterlace(slot, deinterlace);
+
+    if (deinterlace.mode != VicDeinterlace::MotionAdaptive ||
+        (params->flags & VA_DEINTERLACING_ONE_FIELD))
+        return VA_STATUS_SUCCESS;
+
+    /*
+     * The field before the first field of a frame is in the previous frame,
+     * and the field after the second field is in the next one.
+     */
+    VAStatus status = VA_STATUS_SUCCESS;
+    bool first_field = deinterlace.bottom_field == deinterlace.bottom_field_first;
+
+    if (first_field) {
+        op.setSlotSurface(slot, VicSlotSurface::Next, op.input(slot));
+        if (pipeline->num_forward_references > 0)
+            status = setReferenceSurface(ctx, op, slot, VicSlotSurface::Previous,
+                pipeline->forward_references[0]);
+    } else {
+        op.setSlotSurface(slot, VicSlotSurface::Previous, op.input(slot));
+        if (pipeline->num_backward_references > 0)
+            status = setReferenceSurface(ctx, op, slot, VicSlotSurface::Next,
+                pipeline->backward_references[0]);
     }
 
-    if (num_slices > 0) {
-        context->num_slices = num_slices;
-        context->total_slice_size = total_slice_size;
+    return status;
+}
 
-        if (!context->slice_data.get() || context->slice_data->size() < total_slice_size) {
-            auto slice_size = __ALIGN_KERNEL(total_slice_size, 0x10000);
+static VAStatus renderVideoProc(VADriverContextP ctx, Context *context,
+    const VAProcPipelineParameterBuffer *pipeline)
+{
+    VAStatus status;
+    unsigned int i;
 
-            context->slice_data.reset();
+    Surface *surface = DRIVER_DATA->objects.surface(pipeline->surface);
+    if (!surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
 
-            auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
-            int err = gem->allocate(slice_size);
-            if (err)
-                return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    /* The slot count depends on the VIC version, known once it is open */
+    if (DRIVER_DATA->vic->open())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
 
-            context->slice_data = std::move(gem);
-        }
+    if (context->vpp_slots >= DRIVER_DATA->vic->maxSlots())
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
 
-        memset(context->slice_data->map(), 0, context->slice_data->size());
+    VicOp &op = context->vpp_op;
+    unsigned int slot = context->vpp_slots++;
 
-        if (!context->slice_data_offsets.get() ||
-            context->slice_data_offsets->size() < num_slices * 4) {
-            auto size = __ALIGN_KERNEL((num_slices + 1) * 4, 0x1000);
+    op.setSurface(slot, vicSurface(ctx, surface));
+    op.setColorSpace(slot, VicOp::ColorSpace(vicColorStandard(pipeline->surface_color_standard),
+        vicColorRange(pipeline->input_color_properties.color_range)));
 
-            context->slice_data_offsets.reset();
+    for (i = 0; i < pipeline->num_filters; i++) {
+        Buffer *buffer = DRIVER_DATA->objects.buffer(pipeline->filters[i]);
+        if (!buffer || buffer->type != VAProcFilterParameterBufferType)
+            return VA_STATUS_ERROR_INVALID_BUFFER;
 
-            auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
-            int err = gem->allocate(size);
-            if (err)
-                return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        auto *base = (VAProcFilterParameterBufferBase *)buffer->data.data();
 
-            context->slice_data_offsets = std::move(gem);
+        switch (base->type) {
+        case VAProcFilterDeinterlacing:
+            status = setDeinterlacing(ctx, op, slot, pipeline,
+                (VAProcFilterParameterBufferDeinterlacing *)base);
+            break;
+        case VAProcFilterNoiseReduction:
+            op.setDenoise(slot, ((VAProcFilterParameterBuffer *)base)->value);
+            status = VA_STATUS_SUCCESS;
+            break;
+        default:
+            status = VA_STATUS_ERROR_UNSUPPORTED_FILTER;
         }
 
-        memset(context->slice_data_offsets->map(), 0, context->slice_data_offsets->size());
+        if (status != VA_STATUS_SUCCESS)
+            return status;
     }
 
-    uint32_t current_slice_data_offset = 0;
-    uint32_t current_slice_idx = 0;
+    /* Motion maps and noise-reduced frames are carried over between frames of the stream */
+    if (op.deinterlace(slot).mode == VicDeinterlace::MotionAdaptive || op.denoise(slot) > 0.0f) {
+        if (!context->vpp_history[slot])
+            context->vpp_history[slot] = std::make_unique<VicHistory>(*DRIVER_DATA->drm);
+
+        if (context->vpp_history[slot]->apply(op, slot))
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    if (pipeline->surface_region) {
+        const VARectangle *r = pipeline->surface_region;
+        op.setSourceRect(slot, VicOp::Rect(r->x, r->y, r->width, r->height));
+    }
+
+    if (pipeline->output_region) {
+        const VARectangle *r = pipeline->output_region;
+        op.setDestRect(slot, VicOp::Rect(r->x, r->y, r->width, r->height));
+    }
+
+    /* Output-wide state is taken from the bottom-most input */
+    if (slot == 0) {
+        /* Background is given as ARGB8888 */
+        uint32_t bg = pipeline->output_background_color;
+        op.setClear(((bg >> 16) & 0xff) / 255.0f, ((bg >> 8) & 0xff) / 255.0f,
+            (bg & 0xff) / 255.0f);
+
+        op.setOutputColorSpace(VicOp::ColorSpace(
+            vicColorStandard(pipeline->output_color_standard),
+            vicColorRange(pipeline->output_color_properties.color_range)));
+        op.setFilter(vicFilter(pipeline->filter_flags));
+
+        status = setOrientation(op, pipeline->rotation_state, pipeline->mirror_state);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+
+        if (pipeline->num_additional_outputs > VicDevice::MAX_BATCH - 1)
+            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+
+        for (i = 0; i < pipeline->num_additional_outputs; i++) {
+            if (!DRIVER_DATA->objects.surface(pipeline->additional_outputs[i]))
+                return VA_STATUS_ERROR_INVALID_SURFACE;
+
+            context->vpp_additional_outputs.push_back(pipeline->additional_outputs[i]);
+        }
+    }
+
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Decode processing: once NVDEC is done, VIC scales the decoded picture into
+ * the additional outputs of the pipeline, e.g. RGB thumbnails.
+ */
+static VAStatus renderDecodeProc(VADriverContextP ctx, Context *context,
+    const VAProcPipelineParameterBuffer *pipeline)
+{
+    unsigned int i;
+
+    // One op of the batch is kept for detiling linear render targets
+    if (pipeline->num_additional_outputs > VicDevice::MAX_BATCH - 1)
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+
+    VicOp &op = context->dec_proc_op;
+    op = VicOp();
+
+    op.setColorSpace(0, VicOp::ColorSpace(vicColorStandard(pipeline->surface_color_standard),
+        vicColorRange(pipeline->input_color_properties.color_range)));
+    op.setOutputColorSpace(VicOp::ColorSpace(vicColorStandard(pipeline->output_color_standard),
+        vicColorRange(pipeline->output_color_properties.color_range)));
+    op.setFilter(vicFilter(pipeline->filter_flags));
+
+    uint32_t bg = pipeline->output_background_color;
+    op.setClear(((bg >> 16) & 0xff) / 255.0f, ((bg >> 8) & 0xff) / 255.0f, (bg & 0xff) / 255.0f);
+
+    if (pipeline->surface_region) {
+        const VARectangle *r = pipeline->surface_region;
+        op.setSourceRect(0, VicOp::Rect(r->x, r->y, r->width, r->height));
+    }
+
+    if (pipeline->output_region) {
+        const VARectangle *r = pipeline->output_region;
+        op.setDestRect(0, VicOp::Rect(r->x, r->y, r->width, r->height));
+    }
+
+    context->dec_proc_outputs.clear();
+    for (i = 0; i < pipeline->num_additional_outputs; i++) {
+        if (!DRIVER_DATA->objects.surface(pipeline->additional_outputs[i]))
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+
+        context->dec_proc_outputs.push_back(pipeline->additional_outputs[i]);
+    }
+
+    return VA_STATUS_SUCCESS;
+}
+
+/* Whether a parameter buffer shows its picture uses inter prediction */
+static bool predictsInter(Context *context, Buffer *buffer)
+{
+    if (buffer->type == VAPictureParameterBufferType &&
+        context->op.codec() == NvdecCodec::MPEG2) {
+        auto *params = (VAPictureParameterBufferMPEG2 *)buffer->data.data();
+        // 1 is an I picture
+        return params->picture_coding_type != 1;
+    }
+
+    if (buffer->type == VASliceParameterBufferType && context->op.codec() == NvdecCodec::H264) {
+        auto *params = (VASliceParameterBufferH264 *)buffer->data.data();
+        // I and SI slices, the types repeat from 5 on
+        return params->slice_type % 5 != 2 && params->slice_type % 5 != 4;
+    }
+
+    return false;
+}
+
+FUNC(RenderPicture, VAContextID context_id, VABufferID *buffers, int num_buffers)
+{
+    int i;
+
+    Context *context = DRIVER_DATA->objects.context(context_id);
+    if (!context)
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+
+    if (context->video_proc) {
+        for (i = 0; i < num_buffers; i++) {
+            Buffer *buffer = DRIVER_DATA->objects.buffer(buffers[i]);
+            if (!buffer)
+                return VA_STATUS_ERROR_INVALID_BUFFER;
+
+            /* The luma histogram of the output, for scene change detection and the like */
+            if (buffer->type == VAStatsStatisticsBufferType) {
+                if (buffer->gem->size() < VicDevice::HISTOGRAM_SIZE)
+                    return VA_STATUS_ERROR_INVALID_BUFFER;
+
+                void *histogram = buffer->gem->map();
+                if (!histogram)
+                    return VA_STATUS_ERROR_OPERATION_FAILED;
+
+                memset(histogram, 0, VicDevice::HISTOGRAM_SIZE);
+                context->vpp_op.setHistogram(buffer->gem.get());
+                continue;
+            }
+
+            if (buffer->type != VAProcPipelineParameterBufferType) {
+                printf("WARNING: Trying to use unknown buffer type %u for processing\n",
+                    buffer->type);
+                continue;
+            }
+
+            VAStatus status = renderVideoProc(
+                ctx, context, (VAProcPipelineParameterBuffer *)buffer->data.data());
+            if (status != VA_STATUS_SUCCESS)
+                return status;
+        }
+
+        return VA_STATUS_SUCCESS;
+    }
+
+    for (i = 0; i < num_buffers; i++) {
+        Buffer *buffer = DRIVER_DATA->objects.buffer(buffers[i]);
+        if (!buffer)
+            return VA_STATUS_ERROR_INVALID_BUFFER;
+
+        if (predictsInter(context, buffer))
+            context->intra_picture = false;
+    }
+
+    /* Pictures dropped in keyframe-only mode don't get their slice data copied */
+    if (context->keyframes_only && !context->intra_picture)
+        return VA_STATUS_SUCCESS;
+
+    uint32_t total_slice_size;
+
+    if (context->op.codec() == NvdecCodec::MPEG2)
+        total_slice_size = sizeof(termination_sequence_mpeg2);
+    else if (context->op.codec() == NvdecCodec::H264)
+        total_slice_size = sizeof(termination_sequence_h264);
+    else
+        return VA_STATUS_ERROR_UNKNOWN;
+
+    uint32_t num_slices = 0;
+    for (i = 0; i < num_buffers; i++) {
+        Buffer *buffer = DRIVER_DATA->objects.buffer(buffers[i]);
+        if (!buffer)
+            return VA_STATUS_ERROR_INVALID_BUFFER;
+
+        if (buffer->type != VASliceParameterBufferType)
+            continue;
+
+        auto *buff = (VASliceParameterBufferBase *)buffer->data.data();
+
+        total_slice_size += buff->slice_data_size;
+        if (context->op.codec() == NvdecCodec::H264)
+            total_slice_size += 3;
+
+        if ((buff->slice_data_flag == VA_SLICE_DATA_FLAG_ALL) ||
+            (buff->slice_data_flag & VA_SLICE_DATA_FLAG_BEGIN))
+            num_slices++;
+
+        if (buff->slice_data_flag != VA_SLICE_DATA_FLAG_ALL) {
+            printf("Partial slice!!\n");
+        }
+    }
+
+    if (num_slices > 0) {
+        context->num_slices = num_slices;
+        context->total_slice_size = total_slice_size;
+
+        if (!context->slice_data.get() || context->slice_data->size() < total_slice_size) {
+            auto slice_size = __ALIGN_KERNEL(total_slice_size, 0x10000);
+
+            context->slice_data.reset();
+
+            auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
+            int err = gem->allocate(slice_size);
+            if (err)
+                return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+            context->slice_data = std::move(gem);
+        }
+
+        memset(context->slice_data->map(), 0, context->slice_data->size());
+
+        if (!context->slice_data_offsets.get() ||
+            context->slice_data_offsets->size() < num_slices * 4) {
+            auto size = __ALIGN_KERNEL((num_slices + 1) * 4, 0x1000);
+
+            context->slice_data_offsets.reset();
+
+            auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
+            int err = gem->allocate(size);
+            if (err)
+                return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+            context->slice_data_offsets = std::move(gem);
+        }
+
+        memset(context->slice_data_offsets->map(), 0, context->slice_data_offsets->size());
+    }
+
+    uint32_t current_slice_data_offset = 0;
+    uint32_t current_slice_idx = 0;
     VASliceParameterBufferBase current_slice_param;
 
     for (i = 0; i < num_buffers; i++) {
@@ -454,8 +1205,7 @@ FUNC(RenderPicture, VAContextID context_id, VABufferID *buffers, int num_buffers
         Surface *ref = DRIVER_DATA->objects.surface((surface_id)); \
         if (!ref) \
             return VA_STATUS_ERROR_INVALID_SURFACE; \
-        Buffer *buf = DRIVER_DATA->objects.buffer(ref->buffer); \
-        output = buf->gem.get(); \
+        output = decodeBuffer(ctx, ref); \
     }
 
             switch (context->op.codec()) {
@@ -522,6 +1272,14 @@ FUNC(RenderPicture, VAContextID context_id, VABufferID *buffers, int num_buffers
 
             break;
         }
+        case VAProcPipelineParameterBufferType: {
+            VAStatus status = renderDecodeProc(
+                ctx, context, (VAProcPipelineParameterBuffer *)buffer->data.data());
+            if (status != VA_STATUS_SUCCESS)
+                return status;
+
+            break;
+        }
         default:
             printf("WARNING: Trying to use unknown buffer type %u for rendering\n", buffer->type);
             break;
@@ -547,15 +1305,76 @@ FUNC(RenderPicture, VAContextID context_id, VABufferID *buffers, int num_buffers
     return VA_STATUS_SUCCESS;
 }
 
+/*
+ * Retargets a video processing op to another output, scaling the rectangles
+ * given on the output by the size ratio between the two.
+ */
+static void retargetVicOp(VicOp &op, const VicOp::Surface &output)
+{
+    float scale_x = (float)output.width / op.output().width;
+    float scale_y = (float)output.height / op.output().height;
+    unsigned int slot;
+
+    auto scale = [&](const VicOp::Rect &r) {
+        return VicOp::Rect(r.x * scale_x, r.y * scale_y, r.width * scale_x, r.height * scale_y);
+    };
+
+    for (slot = 0; slot < VicOp::MAX_SLOTS; slot++)
+        if (op.input(slot).bo && !op.destRect(slot).empty())
+            op.setDestRect(slot, scale(op.destRect(slot)));
+
+    if (!op.targetRect().empty())
+        op.setTargetRect(scale(op.targetRect()));
+
+    op.setOutput(output);
+}
+
 FUNC(EndPicture, VAContextID context_id)
 {
     Context *context = DRIVER_DATA->objects.context(context_id);
     if (!context)
         return VA_STATUS_ERROR_INVALID_CONTEXT;
 
+    if (context->video_proc) {
+        if (context->vpp_slots == 0)
+            return VA_STATUS_SUCCESS;
+
+        context->vpp_slots = 0;
+
+        if (DRIVER_DATA->vic->open())
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+
+        /* All renditions of the picture are processed in one submission */
+        std::array<VicOp, VicDevice::MAX_BATCH> ops;
+        size_t num_ops = 0;
+
+        ops[num_ops++] = context->vpp_op;
+        for (VASurfaceID output_id : context->vpp_additional_outputs) {
+            Surface *output = DRIVER_DATA->objects.surface(output_id);
+            if (!output)
+                return VA_STATUS_ERROR_INVALID_SURFACE;
+
+            ops[num_ops] = context->vpp_op;
+            ops[num_ops].setHistogram(nullptr);
+            retargetVicOp(ops[num_ops++], vicSurface(ctx, output));
+        }
+
+        if (DRIVER_DATA->vic->run(ops.data(), num_ops))
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+
+        return VA_STATUS_SUCCESS;
+    }
+
+    if (context->keyframes_only && !context->intra_picture)
+        return VA_STATUS_SUCCESS;
+
     if (DRIVER_DATA->nvdec->open())
         return VA_STATUS_ERROR_OPERATION_FAILED;
 
+    /* NVDEC may read or overwrite surfaces an asynchronous VIC copy is still using */
+    if (DRIVER_DATA->vic->sync())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
     context->op.setSliceData(context->slice_data.get());
     context->op.setSliceDataOffsets(context->slice_data_offsets.get());
     context->op.setSliceDataLength(context->total_slice_size);
@@ -564,11 +1383,60 @@ FUNC(EndPicture, VAContextID context_id)
     if (DRIVER_DATA->nvdec->run(context->op))
         return VA_STATUS_ERROR_OPERATION_FAILED;
 
+    Surface *surface = DRIVER_DATA->objects.surface(context->render_target);
+    if (!surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    bool detile = surface->tiled_buffer != VA_INVALID_ID;
+    if (!detile && context->dec_proc_outputs.empty())
+        return VA_STATUS_SUCCESS;
+
+    if (DRIVER_DATA->vic->open())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    /* Detiling and all outputs of the decode processing pipeline are written in one submission */
+    std::array<VicOp, VicDevice::MAX_BATCH> ops;
+    size_t num_ops = 0;
+
+    VicOp::Surface decoded = vicSurface(ctx, surface);
+    decoded.bo = decodeBuffer(ctx, surface);
+    decoded.format = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB;
+
+    if (detile) {
+        ops[num_ops].setSurface(0, decoded);
+        ops[num_ops].setOutput(vicSurface(ctx, surface));
+        ops[num_ops++].setFilter(VicFilter::Nearest);
+    }
+
+    context->dec_proc_op.setSurface(0, decoded);
+    for (VASurfaceID output_id : context->dec_proc_outputs) {
+        Surface *output = DRIVER_DATA->objects.surface(output_id);
+        if (!output)
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+
+        ops[num_ops] = context->dec_proc_op;
+        ops[num_ops++].setOutput(vicSurface(ctx, output));
+    }
+
+    if (DRIVER_DATA->vic->run(ops.data(), num_ops))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
     return VA_STATUS_SUCCESS;
 }
 
 FUNC(SyncSurface, VASurfaceID render_target)
 {
+    Surface *surface = DRIVER_DATA->objects.surface(render_target);
+    if (!surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    if (surface->vic_pending) {
+        surface->vic_pending = false;
+
+        if (DRIVER_DATA->vic->wait(surface->vic_fence))
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -584,6 +1452,183 @@ FUNC(QuerySurfaceError, VASurfaceID render_target, VAStatus error_status, void *
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
+/* Clips a rectangle to a width x height surface, returns false if nothing is left */
+static bool clipRect(int x, int y, unsigned int width, unsigned int height,
+    unsigned int max_width, unsigned int max_height, VicOp::Rect *rect)
+{
+    int x0 = std::max(x, 0), y0 = std::max(y, 0);
+    int x1 = std::min<int>(x + width, max_width);
+    int y1 = std::min<int>(y + height, max_height);
+
+    if (x1 <= x0 || y1 <= y0)
+        return false;
+
+    *rect = VicOp::Rect(x0, y0, x1 - x0, y1 - y0);
+
+    return true;
+}
+
+/* One axis of clipScaled(), with spans as [start, end) */
+static bool clipAxis(double &src0, double &src1, double src_max, double &dst0, double &dst1,
+    double dst_max)
+{
+    if (src1 <= src0 || dst1 <= dst0)
+        return false;
+
+    double scale = (src1 - src0) / (dst1 - dst0);
+
+    if (dst0 < 0) {
+        src0 -= dst0 * scale;
+        dst0 = 0;
+    }
+    if (dst1 > dst_max) {
+        src1 -= (dst1 - dst_max) * scale;
+        dst1 = dst_max;
+    }
+    if (src0 < 0) {
+        dst0 -= src0 / scale;
+        src0 = 0;
+    }
+    if (src1 > src_max) {
+        dst1 -= (src1 - src_max) / scale;
+        src1 = src_max;
+    }
+
+    return src1 > src0 && dst1 > dst0;
+}
+
+/*
+ * Clips a source rectangle to its surface and the destination rectangle it
+ * is scaled to to its own. What is cut from one is cut from the other in
+ * proportion, so the visible part keeps its position and scale. Returns false
+ * if nothing is left.
+ */
+static bool clipScaled(int src_x, int src_y, unsigned int src_width, unsigned int src_height,
+    unsigned int src_max_width, unsigned int src_max_height, int dst_x, int dst_y,
+    unsigned int dst_width, unsigned int dst_height, unsigned int dst_max_width,
+    unsigned int dst_max_height, VicOp::Rect *src, VicOp::Rect *dst)
+{
+    double sx0 = src_x, sx1 = (double)src_x + src_width;
+    double sy0 = src_y, sy1 = (double)src_y + src_height;
+    double dx0 = dst_x, dx1 = (double)dst_x + dst_width;
+    double dy0 = dst_y, dy1 = (double)dst_y + dst_height;
+
+    if (!clipAxis(sx0, sx1, src_max_width, dx0, dx1, dst_max_width) ||
+        !clipAxis(sy0, sy1, src_max_height, dy0, dy1, dst_max_height))
+        return false;
+
+    /* Source edges round outwards, so partially visible pixels are still sampled */
+    int x0 = floor(sx0), x1 = ceil(sx1), y0 = floor(sy0), y1 = ceil(sy1);
+    int dx = lround(dx0), dw = lround(dx1) - dx;
+    int dy = lround(dy0), dh = lround(dy1) - dy;
+
+    if (dw <= 0 || dh <= 0)
+        return false;
+
+    *src = VicOp::Rect(x0, y0, x1 - x0, y1 - y0);
+    *dst = VicOp::Rect(dx, dy, dw, dh);
+
+    return true;
+}
+
+/*
+ * Places the subpictures associated to a surface on top of the VIC slots
+ * already in use. Subpicture destination rectangles are given on the surface,
+ * which is shown at (src_x, src_y) scaled by scale_x/scale_y, unless they are
+ * in screen coordinates.
+ */
+static VAStatus addSubpictures(VADriverContextP ctx, VicOp &op, unsigned int first_slot,
+    Surface *surface, int src_x, int src_y, float scale_x, float scale_y)
+{
+    unsigned int slot = first_slot;
+
+    for (const SubpictureAssociation &assoc : surface->subpictures) {
+        if (slot >= DRIVER_DATA->vic->maxSlots()) {
+            printf("WARNING: Too many subpictures, ignoring the rest\n");
+            break;
+        }
+
+        Subpicture *subpicture = DRIVER_DATA->objects.subpicture(assoc.subpicture);
+        if (!subpicture)
+            return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+        Image *image = DRIVER_DATA->objects.image(subpicture->image);
+        if (!image)
+            return VA_STATUS_ERROR_INVALID_IMAGE;
+
+        VARectangle dst = assoc.dst;
+        if (!(assoc.flags & VA_SUBPICTURE_DESTINATION_IS_SCREEN_COORD)) {
+            dst.x = (dst.x - src_x) * scale_x;
+            dst.y = (dst.y - src_y) * scale_y;
+            dst.width = dst.width * scale_x;
+            dst.height = dst.height * scale_y;
+        }
+
+        /* VIC rectangles cannot start or end off-surface, on the subpicture or the output */
+        VicOp::Rect src_rect, dst_rect;
+        if (!clipScaled(assoc.src.x, assoc.src.y, assoc.src.width, assoc.src.height,
+                image->desc.width, image->desc.height, dst.x, dst.y, dst.width, dst.height,
+                op.output().width, op.output().height, &src_rect, &dst_rect))
+            continue;
+
+        VicOp::Blend blend;
+        blend.enabled = true;
+        blend.global_alpha =
+            (assoc.flags & VA_SUBPICTURE_GLOBAL_ALPHA) ? subpicture->global_alpha : 1.0f;
+#ifdef VA_SUBPICTURE_PREMULTIPLIED_ALPHA
+        blend.premultiplied = (assoc.flags & VA_SUBPICTURE_PREMULTIPLIED_ALPHA) != 0;
+#endif
+
+        op.setSurface(slot, vicImage(image));
+        op.setSourceRect(slot, src_rect);
+        op.setDestRect(slot, dst_rect);
+        op.setBlend(slot, blend);
+
+        slot++;
+    }
+
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * GEM buffer behind a DRI2 buffer name of a drawable. DRI2 hands out new
+ * buffers when the drawable is resized, so the old ones are dropped then;
+ * otherwise the least recently used buffer makes room.
+ */
+static GemBuffer *drawableBuffer(VADriverContextP ctx, struct dri_drawable *dri_drawable,
+    uint32_t name)
+{
+    DriverData *dd = DRIVER_DATA;
+    DrawableBuffer *victim = &dd->drawable_buffers[0];
+
+    for (DrawableBuffer &entry : dd->drawable_buffers) {
+        if (entry.gem && entry.drawable == dri_drawable->x_drawable &&
+            (entry.width != dri_drawable->width || entry.height != dri_drawable->height))
+            entry.gem.reset();
+
+        if (entry.gem && entry.drawable == dri_drawable->x_drawable && entry.name == name) {
+            entry.last_use = ++dd->drawable_clock;
+            return entry.gem.get();
+        }
+
+        if (victim->gem && (!entry.gem || entry.last_use < victim->last_use))
+            victim = &entry;
+    }
+
+    auto gem = std::make_unique<GemBuffer>(*dd->drm);
+    if (gem->openByName(name))
+        return nullptr;
+
+    victim->drawable = dri_drawable->x_drawable;
+    victim->name = name;
+    victim->width = dri_drawable->width;
+    victim->height = dri_drawable->height;
+    victim->last_use = ++dd->drawable_clock;
+    victim->gem = std::move(gem);
+
+    return victim->gem.get();
+}
+
 FUNC(PutSurface, VASurfaceID surface, void *draw, short srcx, short srcy, unsigned short srcw,
     unsigned short srch, short destx, short desty, unsigned short destw, unsigned short desth,
     VARectangle *cliprects, unsigned int number_cliprects, unsigned int flags)
@@ -591,13 +1636,12 @@ FUNC(PutSurface, VASurfaceID surface, void *draw, short srcx, short srcy, unsign
     struct dri_drawable *dri_drawable;
     union dri_buffer *dri_buffer;
 
-    DrmDevice &device = *DRIVER_DATA->drm;
-
     dri_drawable = va_dri_get_drawable(ctx, (Drawable)draw);
     dri_buffer = va_dri_get_rendering_buffer(ctx, dri_drawable);
 
-    GemBuffer buffer(device);
-    buffer.openByName(dri_buffer->dri2.name);
+    GemBuffer *buffer = drawableBuffer(ctx, dri_drawable, dri_buffer->dri2.name);
+    if (!buffer)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
 
     if (DRIVER_DATA->vic->open())
         return VA_STATUS_ERROR_OPERATION_FAILED;
@@ -605,7 +1649,7 @@ FUNC(PutSurface, VASurfaceID surface, void *draw, short srcx, short srcy, unsign
     VicOp op;
 
     VicOp::Surface op_out;
-    op_out.bo = &buffer;
+    op_out.bo = buffer;
     op_out.width = destw;
     op_out.height = desth;
     op_out.pitch = dri_buffer->dri2.pitch / 4;
@@ -613,19 +1657,22 @@ FUNC(PutSurface, VASurfaceID surface, void *draw, short srcx, short srcy, unsign
     op_out.format = DRM_FORMAT_MOD_LINEAR;
 
     Surface *sf = DRIVER_DATA->objects.surface(surface);
-    VicOp::Surface op_in;
-    op_in.bo = DRIVER_DATA->objects.buffer(sf->buffer)->gem.get();
+    VicOp::Surface op_in = vicSurface(ctx, sf);
     op_in.x = srcx;
     op_in.y = srcy;
     op_in.width = srcw;
     op_in.height = srch;
-    op_in.pitch = sf->pitch;
-    op_in.fourcc = DRM_FORMAT_NV12;
-    op_in.format = DRM_FORMAT_MOD_LINEAR;
 
     op.setClear(0.0, 1.0, 0.0);
     op.setOutput(op_out);
     op.setSurface(0, op_in);
+    op.setColorSpace(0, VicOp::ColorSpace(vicSourceStandard(flags), VicColorRange::Limited));
+    op.setFilter(vicFilter(flags));
+
+    VAStatus status = addSubpictures(ctx, op, 1, sf, srcx, srcy, (float)destw / srcw,
+        (float)desth / srch);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
 
     DRIVER_DATA->vic->run(op);
 
@@ -636,32 +1683,64 @@ FUNC(PutSurface, VASurfaceID surface, void *draw, short srcx, short srcy, unsign
 
 FUNC(QueryImageFormats, VAImageFormat *format_list, int *num_formats)
 {
-    format_list[0].fourcc = VA_FOURCC_NV12;
-    format_list[0].byte_order = VA_LSB_FIRST;
-    format_list[0].bits_per_pixel = 24;
+    int i = 0;
 
-    *num_formats = 1;
+    for (const ImageFormat &format : image_formats)
+        format_list[i++] = format.va;
+
+    *num_formats = i;
 
     return VA_STATUS_SUCCESS;
 }
 
 FUNC(CreateImage, VAImageFormat *format, int width, int height, VAImage *image_data)
 {
+    const ImageFormat *image_format = imageFormat(format->fourcc);
+    if (!image_format)
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+
     Image *image = DRIVER_DATA->objects.createImage(&image_data->image_id);
     Buffer *buffer = DRIVER_DATA->objects.createBuffer(&image_data->buf);
 
-    image_data->format = *format;
+    image_data->format = image_format->va;
     image_data->width = width;
     image_data->height = height;
-    image_data->data_size = width * height * 3;
-    image_data->num_planes = 2;
-    image_data->pitches[0] = __ALIGN_KERNEL(width, 256);
-    image_data->pitches[1] = __ALIGN_KERNEL(width, 256);
-    image_data->offsets[0] = 0;
-    image_data->offsets[1] = image_data->pitches[0] * __ALIGN_KERNEL(height, 16);
     image_data->num_palette_entries = 0;
     image_data->entry_bytes = 0;
 
+    /*
+     * Planes follow each other with a 256-byte aligned pitch and a 16 line
+     * aligned height, the layout VicOp::Surface::planeOffset() expects.
+     */
+    uint32_t pitch = __ALIGN_KERNEL(width * image_format->cpp, 256);
+    uint32_t luma_size = pitch * __ALIGN_KERNEL(height, 16);
+
+    image_data->pitches[0] = pitch;
+    image_data->offsets[0] = 0;
+
+    switch (image_format->drm_fourcc) {
+    case DRM_FORMAT_NV12:
+        image_data->num_planes = 2;
+        image_data->pitches[1] = pitch;
+        image_data->offsets[1] = luma_size;
+        image_data->data_size = luma_size * 3 / 2;
+        break;
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        /* Plane 1 is U for I420 and V for YV12, as VIC lays them out */
+        image_data->num_planes = 3;
+        image_data->pitches[1] = pitch / 2;
+        image_data->pitches[2] = pitch / 2;
+        image_data->offsets[1] = luma_size;
+        image_data->offsets[2] = luma_size + luma_size / 4;
+        image_data->data_size = luma_size * 3 / 2;
+        break;
+    default:
+        image_data->num_planes = 1;
+        image_data->data_size = luma_size;
+        break;
+    }
+
     auto gem = std::make_unique<GemBuffer>(*DRIVER_DATA->drm);
     int err = gem->allocate(image_data->data_size);
     if (err)
@@ -670,6 +1749,7 @@ FUNC(CreateImage, VAImageFormat *format, int width, int height, VAImage *image_d
     buffer->gem = std::move(gem);
 
     image->buffer = buffer;
+    image->desc = *image_data;
 
     return VA_STATUS_SUCCESS;
 }
@@ -677,6 +1757,12 @@ FUNC(CreateImage, VAImageFormat *format, int width, int height, VAImage *image_d
 FUNC(DeriveImage, VASurfaceID surface, VAImage *image)
 {
     Surface *s = DRIVER_DATA->objects.surface(surface);
+    if (!s)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    /* Block linear surfaces can't be mapped as they are, vaGetImage() detiles them */
+    if (s->modifier != DRM_FORMAT_MOD_LINEAR)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
 
     image->format.fourcc = s->format;
     image->buf = s->buffer;
@@ -685,7 +1771,7 @@ FUNC(DeriveImage, VASurfaceID surface, VAImage *image)
     image->width = s->width;
     image->height = s->height;
     image->data_size = DRIVER_DATA->objects.buffer(s->buffer)->gem->size();
-    image->num_planes = 2;
+    image->num_planes = s->format == VA_FOURCC_NV12 ? 2 : 1;
 
     image->pitches[0] = s->pitch;
     image->pitches[1] = s->pitch;
@@ -721,6 +1807,35 @@ FUNC(SetImagePalette, VAImageID image, unsigned char *palette)
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
+/*
+ * Copies a region of a surface into an image in one VIC pass, converting to
+ * the image format. The rest of the image is left untouched.
+ */
+static VAStatus getImageRegion(VADriverContextP ctx, Surface *surface, Image *image,
+    const VicOp::Rect &src, const VicOp::Rect &dst)
+{
+    if (DRIVER_DATA->vic->open())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    VicOp op;
+
+    op.setOutput(vicImage(image));
+    op.setSurface(0, vicSurface(ctx, surface));
+    op.setSourceRect(0, src);
+    op.setDestRect(0, dst);
+    op.setTargetRect(dst);
+
+    VAStatus status = addSubpictures(ctx, op, 1, surface, src.x, src.y,
+        (float)dst.width / src.width, (float)dst.height / src.height);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    if (DRIVER_DATA->vic->run(op))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    return VA_STATUS_SUCCESS;
+}
+
 FUNC(GetImage, VASurfaceID surface_id, int x, int y, unsigned int width, unsigned int height,
     VAImageID image_id)
 {
@@ -732,32 +1847,44 @@ FUNC(GetImage, VASurfaceID surface_id, int x, int y, unsigned int width, unsigne
     if (!image)
         return VA_STATUS_ERROR_INVALID_IMAGE;
 
-    Buffer *surface_buffer = DRIVER_DATA->objects.buffer(surface->buffer);
+    /* Only the requested region is read, into the top left corner of the image */
+    VicOp::Rect src, dst;
+    if (!clipRect(x, y, std::min<unsigned int>(width, image->desc.width),
+            std::min<unsigned int>(height, image->desc.height), surface->width,
+            surface->height, &src))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
 
-    void *surface_map = surface_buffer->gem->map();
-    void *image_map = image->buffer->gem->map();
-    if (!surface_map || !image_map)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    dst = VicOp::Rect(0, 0, src.width, src.height);
 
-    VicOp op;
+    return getImageRegion(ctx, surface, image, src, dst);
+}
 
-    VicOp::Surface op_out;
-    op_out.bo = image->buffer->gem.get();
-    op_out.width = surface->width;
-    op_out.height = surface->height;
-    op_out.pitch = surface->pitch;
-    op_out.fourcc = DRM_FORMAT_NV12;
-    op_out.format = DRM_FORMAT_MOD_LINEAR;
-    op.setOutput(op_out);
+FUNC(PutImage, VASurfaceID surface_id, VAImageID image_id, int src_x, int src_y,
+    unsigned int src_width, unsigned int src_height, int dest_x, int dest_y,
+    unsigned int dest_width, unsigned int dest_height)
+{
+    Surface *surface = DRIVER_DATA->objects.surface(surface_id);
+    if (!surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
 
-    VicOp::Surface op_in;
-    op_in.bo = surface_buffer->gem.get();
-    op_in.width = surface->width;
-    op_in.height = surface->height;
-    op_in.pitch = surface->pitch;
-    op_in.fourcc = DRM_FORMAT_NV12;
-    op_in.format = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB;
-    op.setSurface(0, op_in);
+    Image *image = DRIVER_DATA->objects.image(image_id);
+    if (!image)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    VicOp::Rect src, dst;
+    if (!clipScaled(src_x, src_y, src_width, src_height, image->desc.width, image->desc.height,
+            dest_x, dest_y, dest_width, dest_height, surface->width, surface->height, &src,
+            &dst))
+        return VA_STATUS_SUCCESS;
+
+    VicOp op;
+
+    /* Only the destination rectangle of the surface is overwritten */
+    op.setOutput(vicSurface(ctx, surface));
+    op.setTargetRect(dst);
+    op.setSurface(0, vicImage(image));
+    op.setSourceRect(0, src);
+    op.setDestRect(0, dst);
 
     if (DRIVER_DATA->vic->open())
         return VA_STATUS_ERROR_OPERATION_FAILED;
@@ -768,32 +1895,139 @@ FUNC(GetImage, VASurfaceID surface_id, int x, int y, unsigned int width, unsigne
     return VA_STATUS_SUCCESS;
 }
 
-FUNC(PutImage, VASurfaceID surface, VAImageID image, int src_x, int src_y, unsigned int src_width,
-    unsigned int src_height, int dest_x, int dest_y, unsigned int dest_width,
-    unsigned int dest_height)
+#if VA_CHECK_VERSION(1, 12, 0)
+/*
+ * Surface to surface copy as a VIC pass-through blit, converting between the
+ * layouts of both surfaces. Asynchronous copies are waited on in SyncSurface.
+ */
+FUNC(Copy, VACopyObject *dst_obj, VACopyObject *src_obj, VACopyOption option)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    if (dst_obj->obj_type != VACopyObjectSurface || src_obj->obj_type != VACopyObjectSurface)
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+
+    Surface *dst = DRIVER_DATA->objects.surface(dst_obj->object.surface_id);
+    Surface *src = DRIVER_DATA->objects.surface(src_obj->object.surface_id);
+    if (!dst || !src)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    VicOp op;
+    VicOp::Rect rect(0, 0, std::min(dst->width, src->width), std::min(dst->height, src->height));
+
+    op.setOutput(vicSurface(ctx, dst));
+    op.setTargetRect(rect);
+    op.setSurface(0, vicSurface(ctx, src));
+    op.setSourceRect(0, rect);
+    op.setDestRect(0, rect);
+    op.setFilter(VicFilter::Nearest);
+
+    if (DRIVER_DATA->vic->open())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    uint32_t fence;
+    if (DRIVER_DATA->vic->submit(&op, 1, &fence))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    if (option.bits.va_copy_sync == VA_EXEC_ASYNC) {
+        dst->vic_pending = true;
+        dst->vic_fence = fence;
+        return VA_STATUS_SUCCESS;
+    }
+
+    if (DRIVER_DATA->vic->wait(fence))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    return VA_STATUS_SUCCESS;
 }
+#endif
 
 FUNC(QuerySubpictureFormats, VAImageFormat *format_list, unsigned int *flags,
     unsigned int *num_formats)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    format_list[0].fourcc = VA_FOURCC_BGRA;
+    format_list[0].byte_order = VA_LSB_FIRST;
+    format_list[0].bits_per_pixel = 32;
+    format_list[0].depth = 32;
+    format_list[0].red_mask = 0x00ff0000;
+    format_list[0].green_mask = 0x0000ff00;
+    format_list[0].blue_mask = 0x000000ff;
+    format_list[0].alpha_mask = 0xff000000;
+
+    if (flags) {
+        flags[0] = VA_SUBPICTURE_GLOBAL_ALPHA | VA_SUBPICTURE_DESTINATION_IS_SCREEN_COORD;
+#ifdef VA_SUBPICTURE_PREMULTIPLIED_ALPHA
+        flags[0] |= VA_SUBPICTURE_PREMULTIPLIED_ALPHA;
+#endif
+    }
+
+    *num_formats = 1;
+
+    return VA_STATUS_SUCCESS;
 }
 
-FUNC(CreateSubpicture, VAImageID image, VASubpictureID *subpicture)
+FUNC(CreateSubpicture, VAImageID image, VASubpictureID *subpicture_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    Image *img = DRIVER_DATA->objects.image(image);
+    if (!img)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    if (img->desc.format.fourcc != VA_FOURCC_BGRA)
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+
+    Subpicture *subpicture = DRIVER_DATA->objects.createSubpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    subpicture->image = image;
+    subpicture->global_alpha = 1.0f;
+
+    return VA_STATUS_SUCCESS;
 }
 
-FUNC(DestroySubpicture, VASubpictureID subpicture)
+static void deassociateSubpicture(VADriverContextP ctx, VASubpictureID subpicture_id,
+    VASurfaceID surface_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    Surface *surface = DRIVER_DATA->objects.surface(surface_id);
+    if (!surface)
+        return;
+
+    auto &list = surface->subpictures;
+    for (auto it = list.begin(); it != list.end();) {
+        if (it->subpicture == subpicture_id)
+            it = list.erase(it);
+        else
+            ++it;
+    }
 }
 
-FUNC(SetSubpictureImage, VASubpictureID subpicture, VAImageID image)
+FUNC(DestroySubpicture, VASubpictureID subpicture_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    Subpicture *subpicture = DRIVER_DATA->objects.subpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+    for (VASurfaceID surface_id : subpicture->surfaces)
+        deassociateSubpicture(ctx, subpicture_id, surface_id);
+    subpicture->surfaces.clear();
+
+    return VA_STATUS_SUCCESS;
+}
+
+FUNC(SetSubpictureImage, VASubpictureID subpicture_id, VAImageID image)
+{
+    Subpicture *subpicture = DRIVER_DATA->objects.subpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+    Image *img = DRIVER_DATA->objects.image(image);
+    if (!img)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    if (img->desc.format.fourcc != VA_FOURCC_BGRA)
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+
+    subpicture->image = image;
+
+    return VA_STATUS_SUCCESS;
 }
 
 FUNC(SetSubpictureChromakey, VASubpictureID subpicture, unsigned int chromakey_min,
@@ -802,22 +2036,70 @@ FUNC(SetSubpictureChromakey, VASubpictureID subpicture, unsigned int chromakey_m
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
-FUNC(SetSubpictureGlobalAlpha, VASubpictureID subpicture, float global_alpha)
+FUNC(SetSubpictureGlobalAlpha, VASubpictureID subpicture_id, float global_alpha)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    Subpicture *subpicture = DRIVER_DATA->objects.subpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+    subpicture->global_alpha = global_alpha;
+
+    return VA_STATUS_SUCCESS;
 }
 
-FUNC(AssociateSubpicture, VASubpictureID subpicture, VASurfaceID *target_surfaces, int num_surfaces,
-    short src_x, short src_y, unsigned short src_width, unsigned short src_height, short dest_x,
-    short dest_y, unsigned short dest_width, unsigned short dest_height, unsigned int flags)
+FUNC(AssociateSubpicture, VASubpictureID subpicture_id, VASurfaceID *target_surfaces,
+    int num_surfaces, short src_x, short src_y, unsigned short src_width,
+    unsigned short src_height, short dest_x, short dest_y, unsigned short dest_width,
+    unsigned short dest_height, unsigned int flags)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    int i;
+
+    Subpicture *subpicture = DRIVER_DATA->objects.subpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+    SubpictureAssociation assoc;
+    assoc.subpicture = subpicture_id;
+    assoc.src = { src_x, src_y, src_width, src_height };
+    assoc.dst = { dest_x, dest_y, dest_width, dest_height };
+    assoc.flags = flags;
+
+    for (i = 0; i < num_surfaces; i++) {
+        Surface *surface = DRIVER_DATA->objects.surface(target_surfaces[i]);
+        if (!surface)
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+
+        /* Re-associating only updates the rectangles */
+        deassociateSubpicture(ctx, subpicture_id, target_surfaces[i]);
+        surface->subpictures.push_back(assoc);
+        subpicture->surfaces.push_back(target_surfaces[i]);
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
-FUNC(DeassociateSubpicture, VASubpictureID subpicture, VASurfaceID *target_surfaces,
+FUNC(DeassociateSubpicture, VASubpictureID subpicture_id, VASurfaceID *target_surfaces,
     int num_surfaces)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    int i;
+
+    Subpicture *subpicture = DRIVER_DATA->objects.subpicture(subpicture_id);
+    if (!subpicture)
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+
+    for (i = 0; i < num_surfaces; i++) {
+        deassociateSubpicture(ctx, subpicture_id, target_surfaces[i]);
+
+        auto &list = subpicture->surfaces;
+        for (auto it = list.begin(); it != list.end();) {
+            if (*it == target_surfaces[i])
+                it = list.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
 FUNC(QueryDisplayAttributes, VADisplayAttribute *attr_list, int *num_attributes)
@@ -857,14 +2139,178 @@ FUNC(UnlockSurface, VASurfaceID surface)
 FUNC(QuerySurfaceAttributes, VAConfigID config, VASurfaceAttrib *attrib_list,
     unsigned int *num_attribs)
 {
+    unsigned int i, num = sizeof(surface_formats) / sizeof(surface_formats[0]);
+
     if (attrib_list) {
-        attrib_list[0].type = VASurfaceAttribPixelFormat;
-        attrib_list[0].value.type = VAGenericValueTypeInteger;
-        attrib_list[0].value.value.i = VA_FOURCC_NV12;
-        attrib_list[0].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+        for (i = 0; i < num; i++) {
+            attrib_list[i].type = VASurfaceAttribPixelFormat;
+            attrib_list[i].value.type = VAGenericValueTypeInteger;
+            attrib_list[i].value.value.i = surface_formats[i];
+            attrib_list[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+        }
+
+        attrib_list[num].type = VASurfaceAttribMemoryType;
+        attrib_list[num].value.type = VAGenericValueTypeInteger;
+        attrib_list[num].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_VA |
+            VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME | VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+        attrib_list[num].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+
+        attrib_list[num + 1].type = VASurfaceAttribExternalBufferDescriptor;
+        attrib_list[num + 1].value.type = VAGenericValueTypePointer;
+        attrib_list[num + 1].value.value.p = nullptr;
+        attrib_list[num + 1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    }
+
+    *num_attribs = num + 2;
+
+    return VA_STATUS_SUCCESS;
+}
+
+static VAProcFilterType vpp_filters[] = {
+    VAProcFilterDeinterlacing,
+    VAProcFilterNoiseReduction,
+};
+
+static const VAProcFilterValueRange vpp_denoise_range = { 0.0f, 1.0f, 0.5f, 0.01f };
+
+static VAProcDeinterlacingType vpp_deinterlacing[] = {
+    VAProcDeinterlacingBob,
+    VAProcDeinterlacingWeave,
+    VAProcDeinterlacingMotionAdaptive,
+};
+
+FUNC(QueryVideoProcFilters, VAContextID context, VAProcFilterType *filters,
+    unsigned int *num_filters)
+{
+    unsigned int i, num = sizeof(vpp_filters) / sizeof(vpp_filters[0]);
+
+    if (*num_filters < num)
+        num = *num_filters;
+
+    for (i = 0; i < num; i++)
+        filters[i] = vpp_filters[i];
+
+    *num_filters = num;
+
+    return VA_STATUS_SUCCESS;
+}
+
+FUNC(QueryVideoProcFilterCaps, VAContextID context, VAProcFilterType type, void *filter_caps,
+    unsigned int *num_filter_caps)
+{
+    unsigned int i, num;
+
+    switch (type) {
+    case VAProcFilterDeinterlacing: {
+        auto *caps = (VAProcFilterCapDeinterlacing *)filter_caps;
+
+        num = sizeof(vpp_deinterlacing) / sizeof(vpp_deinterlacing[0]);
+        if (*num_filter_caps < num)
+            num = *num_filter_caps;
+
+        for (i = 0; i < num; i++)
+            caps[i].type = vpp_deinterlacing[i];
+
+        *num_filter_caps = num;
+
+        return VA_STATUS_SUCCESS;
     }
+    case VAProcFilterNoiseReduction: {
+        auto *caps = (VAProcFilterCap *)filter_caps;
 
-    *num_attribs = 1;
+        if (*num_filter_caps < 1)
+            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+
+        caps[0].range = vpp_denoise_range;
+        *num_filter_caps = 1;
+
+        return VA_STATUS_SUCCESS;
+    }
+    default:
+        *num_filter_caps = 0;
+
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
+}
+
+/* RGB surfaces are always taken as sRGB */
+static VAProcColorStandardType vpp_color_standards[] = {
+    VAProcColorStandardBT601,
+    VAProcColorStandardBT709,
+    VAProcColorStandardBT2020,
+    VAProcColorStandardSRGB,
+};
+
+/* Every surface format can be read and written by VIC */
+static uint32_t vpp_pixel_formats[] = {
+    VA_FOURCC_NV12,
+    VA_FOURCC_BGRA,
+    VA_FOURCC_RGBX,
+};
+
+FUNC(QueryVideoProcPipelineCaps, VAContextID context, VABufferID *filters,
+    unsigned int num_filters, VAProcPipelineCaps *pipeline_caps)
+{
+    unsigned int i;
+
+    pipeline_caps->pipeline_flags = 0;
+    pipeline_caps->filter_flags = 0;
+    pipeline_caps->num_forward_references = 0;
+    pipeline_caps->num_backward_references = 0;
+
+    for (i = 0; i < num_filters; i++) {
+        Buffer *buffer = DRIVER_DATA->objects.buffer(filters[i]);
+        if (!buffer || buffer->type != VAProcFilterParameterBufferType)
+            return VA_STATUS_ERROR_INVALID_BUFFER;
+
+        auto *base = (VAProcFilterParameterBufferBase *)buffer->data.data();
+
+        switch (base->type) {
+        case VAProcFilterDeinterlacing: {
+            auto *params = (VAProcFilterParameterBufferDeinterlacing *)base;
+
+            /* Neighbouring fields may come from the previous and next frames */
+            if (params->algorithm == VAProcDeinterlacingMotionAdaptive ||
+                params->algorithm == VAProcDeinterlacingMotionCompensated) {
+                pipeline_caps->num_forward_references = 1;
+                pipeline_caps->num_backward_references = 1;
+            }
+            break;
+        }
+        case VAProcFilterNoiseReduction:
+            /* History is kept internally */
+            break;
+        default:
+            return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+        }
+    }
+    pipeline_caps->input_color_standards = vpp_color_standards;
+    pipeline_caps->num_input_color_standards =
+        sizeof(vpp_color_standards) / sizeof(vpp_color_standards[0]);
+    pipeline_caps->output_color_standards = vpp_color_standards;
+    pipeline_caps->num_output_color_standards =
+        sizeof(vpp_color_standards) / sizeof(vpp_color_standards[0]);
+    pipeline_caps->rotation_flags = (1 << VA_ROTATION_NONE) | (1 << VA_ROTATION_90) |
+                                    (1 << VA_ROTATION_180) | (1 << VA_ROTATION_270);
+    pipeline_caps->blend_flags = 0;
+    pipeline_caps->mirror_flags = VA_MIRROR_HORIZONTAL | VA_MIRROR_VERTICAL;
+    pipeline_caps->num_additional_outputs = VicDevice::MAX_BATCH - 1;
+    pipeline_caps->input_pixel_format = vpp_pixel_formats;
+    pipeline_caps->num_input_pixel_formats =
+        sizeof(vpp_pixel_formats) / sizeof(vpp_pixel_formats[0]);
+    pipeline_caps->output_pixel_format = vpp_pixel_formats;
+    pipeline_caps->num_output_pixel_formats =
+        sizeof(vpp_pixel_formats) / sizeof(vpp_pixel_formats[0]);
+
+    /* Limited by the 14-bit surface size fields in the VIC config struct */
+    pipeline_caps->max_input_width = 1 << 14;
+    pipeline_caps->max_input_height = 1 << 14;
+    pipeline_caps->min_input_width = 1;
+    pipeline_caps->min_input_height = 1;
+    pipeline_caps->max_output_width = 1 << 14;
+    pipeline_caps->max_output_height = 1 << 14;
+    pipeline_caps->min_output_width = 1;
+    pipeline_caps->min_output_height = 1;
 
     return VA_STATUS_SUCCESS;
 }
@@ -872,16 +2318,17 @@ FUNC(QuerySurfaceAttributes, VAConfigID config, VASurfaceAttrib *attrib_list,
 extern "C" VAStatus __vaDriverInit_1_0(VADriverContextP ctx)
 {
     struct VADriverVTable *const vtbl = ctx->vtable;
+    struct VADriverVTableVPP *const vtbl_vpp = ctx->vtable_vpp;
 
     fprintf(stderr, "\nTegra VIC/NVDEC Driver initializing\n");
     fprintf(stderr, "WARNING: This driver is very experimental!\n");
 
     ctx->version_major = 0;
     ctx->version_minor = 1;
-    ctx->max_profiles = 4;
+    ctx->max_profiles = 5;
     ctx->max_entrypoints = 1;
     ctx->max_attributes = 1;
-    ctx->max_image_formats = 1;
+    ctx->max_image_formats = sizeof(image_formats) / sizeof(image_formats[0]);
     ctx->max_subpic_formats = 1;
     ctx->max_display_attributes = 1;
     ctx->str_vendor = "Tegra VIC/NVDEC driver";
@@ -890,6 +2337,7 @@ extern "C" VAStatus __vaDriverInit_1_0(VADriverContextP ctx)
     dd->drm = new DrmDevice;
     dd->vic = new VicDevice(*dd->drm);
     dd->nvdec = new NvdecDevice(*dd->drm);
+    dd->drawable_clock = 0;
 
     ctx->pDriverData = (void *)dd;
 
@@ -940,6 +2388,14 @@ extern "C" VAStatus __vaDriverInit_1_0(VADriverContextP ctx)
     vtbl->vaLockSurface = tegra_LockSurface;
     vtbl->vaUnlockSurface = tegra_UnlockSurface;
     vtbl->vaQuerySurfaceAttributes = tegra_QuerySurfaceAttributes;
+#if VA_CHECK_VERSION(1, 12, 0)
+    vtbl->vaCopy = tegra_Copy;
+#endif
+
+    vtbl_vpp->version = VA_DRIVER_VTABLE_VPP_VERSION;
+    vtbl_vpp->vaQueryVideoProcFilters = tegra_QueryVideoProcFilters;
+    vtbl_vpp->vaQueryVideoProcFilterCaps = tegra_QueryVideoProcFilterCaps;
+    vtbl_vpp->vaQueryVideoProcPipelineCaps = tegra_QueryVideoProcPipelineCaps;
 
     return VA_STATUS_SUCCESS;
 }
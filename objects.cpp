@@ -46,7 +46,7 @@ Surface * Objects::createSurface(VASurfaceID* id)
 
 Surface * Objects::surface(VASurfaceID id)
 {
-    return static_cast<Surface *>(getGeneric(id));
+    return dynamic_cast<Surface *>(getGeneric(id));
 }
 
 Buffer* Objects::createBuffer(VABufferID* id)
@@ -60,7 +60,7 @@ Buffer* Objects::createBuffer(VABufferID* id)
 
 Buffer * Objects::buffer(VABufferID id)
 {
-    return static_cast<Buffer *>(getGeneric(id));
+    return dynamic_cast<Buffer *>(getGeneric(id));
 }
 
 Context* Objects::createContext(VAContextID* id)
@@ -74,7 +74,7 @@ Context* Objects::createContext(VAContextID* id)
 
 Context * Objects::context(VAContextID id)
 {
-    return static_cast<Context *>(getGeneric(id));
+    return dynamic_cast<Context *>(getGeneric(id));
 }
 
 Image* Objects::createImage(VAImageID* id)
@@ -88,7 +88,21 @@ Image* Objects::createImage(VAImageID* id)
 
 Image * Objects::image(VAImageID id)
 {
-    return static_cast<Image *>(getGeneric(id));
+    return dynamic_cast<Image *>(getGeneric(id));
+}
+
+Subpicture* Objects::createSubpicture(VASubpictureID *id)
+{
+    Subpicture *subpicture = new Subpicture;
+
+    *id = addGeneric(subpicture);
+
+    return subpicture;
+}
+
+Subpicture * Objects::subpicture(VASubpictureID id)
+{
+    return dynamic_cast<Subpicture *>(getGeneric(id));
 }
 
 VAGenericID Objects::addGeneric(Object* obj)
@@ -102,11 +116,23 @@ VAGenericID Objects::addGeneric(Object* obj)
     return id;
 }
 
+void Objects::destroy(VAGenericID id)
+{
+    std::lock_guard<std::mutex> g(_lock);
+
+    Object *&obj = _objects.at(id-1);
+
+    delete obj;
+    obj = nullptr;
+}
+
 Object * Objects::getGeneric(VAGenericID id)
 {
     std::lock_guard<std::mutex> g(_lock);
 
-    Object *obj = _objects.at(id-1);
+    /* Unknown and destroyed IDs look up as null */
+    if (id == 0 || id > _objects.size())
+        return nullptr;
 
-    return obj;
+    return _objects[id-1];
 }
@@ -43,16 +43,45 @@ class Image : public Object
 {
 public:
     Buffer *buffer;
+    VAImage desc;
+};
+
+class Subpicture : public Object
+{
+public:
+    VAImageID image;
+    float global_alpha;
+    std::vector<VASurfaceID> surfaces;
+};
+
+struct SubpictureAssociation
+{
+    VASubpictureID subpicture;
+    VARectangle src;
+    VARectangle dst;
+    unsigned int flags;
 };
 
 class Surface : public Object
 {
 public:
+    Surface() : tiled_buffer(VA_INVALID_ID), vic_pending(false), vic_fence(0)
+    { }
+
     uint16_t width;
     uint16_t height;
     uint16_t pitch;
     int format;
+    // DRM format modifier of the surface layout
+    uint64_t modifier;
     VABufferID buffer;
+    // Block linear buffer NVDEC decodes linear surfaces into, detiled by VIC after each picture
+    VABufferID tiled_buffer;
+    std::vector<SubpictureAssociation> subpictures;
+
+    // Set while an asynchronous VIC job writing the surface may be running
+    bool vic_pending;
+    uint32_t vic_fence;
 };
 
 class Objects
@@ -72,6 +101,13 @@ public:
     Image *createImage(VAImageID *id);
     Image *image(VAImageID id);
 
+    Subpicture *createSubpicture(VASubpictureID *id);
+    Subpicture *subpicture(VASubpictureID id);
+
+    // Deletes an object, its ID is not reused and looks it up as null afterwards.
+    // Lookups also return null for IDs of another type of object
+    void destroy(VAGenericID id);
+
 private:
     std::mutex _lock;
     std::vector<Object *> _objects;
@@ -0,0 +1,211 @@
+/* kate: replace-tabs true; indent-width 4
+ *
+ * Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Counts heap allocations made by NvdecDevice::run, VicDevice::run,
+ * VicSoftware::run and VicHistory::apply, and fails if any happen once the
+ * devices are warmed up. History surfaces are also checked to carry over
+ * from one frame to the next. Needs a Tegra with NVDEC and VIC, and exits
+ * with 77 (skipped) without one.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "../gem.h"
+#include "../engines/nvdec.h"
+#include "../engines/vic.h"
+#include "../engines/vic_sw.h"
+#include <libdrm/drm_fourcc.h>
+
+static constexpr int SKIP = 77;
+static constexpr unsigned int WARMUP_FRAMES = 4;
+static constexpr unsigned int FRAMES = 32;
+static constexpr unsigned int WIDTH = 256;
+static constexpr unsigned int HEIGHT = 128;
+
+static std::atomic<size_t> allocations(0);
+
+/* operator new[] and the nothrow variants end up here too */
+void *operator new(size_t size)
+{
+    allocations++;
+
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/* Runs frame() for the warm-up frames, then counts allocations over the next FRAMES */
+template <typename F>
+static int check(const char *name, F frame)
+{
+    for (unsigned int i = 0; i < WARMUP_FRAMES; i++) {
+        if (frame()) {
+            printf("%s: frame %u failed\n", name, i);
+            return 1;
+        }
+    }
+
+    size_t before = allocations;
+
+    for (unsigned int i = 0; i < FRAMES; i++) {
+        if (frame()) {
+            printf("%s: frame %u failed\n", name, WARMUP_FRAMES + i);
+            return 1;
+        }
+    }
+
+    size_t count = allocations - before;
+    printf("%s: %zu allocations in %u frames\n", name, count, FRAMES);
+
+    return count != 0;
+}
+
+/*
+ * One frame of denoised, motion-adaptive deinterlacing. From the second frame
+ * on, the surfaces written last time have to come back as the previous ones,
+ * or the temporal filters never get to run.
+ */
+struct HistoryFrame {
+    VicHistory &history;
+    const VicOp &frame;
+    unsigned int count;
+    GemBuffer *motion;
+    GemBuffer *denoised;
+
+    int operator()() {
+        VicOp op = frame;
+
+        if (history.apply(op, 0))
+            return 1;
+
+        bool carried = op.slotSurface(0, VicSlotSurface::PreviousMotion).bo == motion &&
+                       op.slotSurface(0, VicSlotSurface::Previous).bo == denoised &&
+                       (count < 2 || op.slotSurface(0, VicSlotSurface::PpMotion).bo);
+        if (count++ > 0 && !carried) {
+            printf("VicHistory::apply: history was not carried over to frame %u\n", count - 1);
+            return 1;
+        }
+
+        motion = op.slotSurface(0, VicSlotSurface::CurrentMotion).bo;
+        denoised = op.slotSurface(0, VicSlotSurface::NextNoiseReduced).bo;
+
+        return !motion || !denoised;
+    }
+};
+
+int main()
+{
+    DrmDevice dev;
+    int err = 0;
+
+    if (dev.fd() == -1)
+        return SKIP;
+
+    GemBuffer decoded(dev), output(dev), slice_data(dev), slice_offsets(dev);
+    if (decoded.allocate(WIDTH * HEIGHT * 3 / 2) || output.allocate(WIDTH * HEIGHT * 4) ||
+        slice_data.allocate(0x1000) || slice_offsets.allocate(0x1000))
+        return SKIP;
+
+    NvdecDevice nvdec(dev);
+    VicDevice vic(dev);
+    if (nvdec.open() || vic.open())
+        return SKIP;
+
+    /* Garbage slice data is fine, error concealment still completes the picture */
+    NvdecOp decode;
+    NvdecOp::Surface decode_output;
+    decode_output.bo = &decoded;
+    decode_output.width = WIDTH;
+    decode_output.height = HEIGHT;
+    decode_output.pitch = WIDTH;
+
+    decode.setCodec(NvdecCodec::MPEG2);
+    decode.mpeg2() = NvdecOp::MPEG2();
+    decode.mpeg2().picture_parameters.horizontal_size = WIDTH;
+    decode.mpeg2().picture_parameters.vertical_size = HEIGHT;
+    decode.mpeg2().picture_parameters.picture_coding_type = 1;
+    decode.mpeg2().picture_parameters.picture_coding_extension.bits.picture_structure = 3;
+    decode.setOutput(decode_output);
+    decode.setSliceData(&slice_data);
+    decode.setSliceDataLength(0x1000);
+    decode.setSliceDataOffsets(&slice_offsets);
+    decode.setNumSlices(1);
+
+    /* Decoded picture to RGB, the conversion done for every presented frame */
+    VicOp convert;
+    VicOp::Surface in, out;
+    in.bo = &decoded;
+    in.width = WIDTH;
+    in.height = HEIGHT;
+    in.pitch = WIDTH;
+    in.fourcc = DRM_FORMAT_NV12;
+    in.format = DRM_FORMAT_MOD_NVIDIA_16BX2_BLOCK_TWO_GOB;
+
+    out.bo = &output;
+    out.width = WIDTH;
+    out.height = HEIGHT;
+    out.pitch = WIDTH;
+    out.fourcc = DRM_FORMAT_ARGB8888;
+    out.format = DRM_FORMAT_MOD_LINEAR;
+
+    convert.setSurface(0, in);
+    convert.setOutput(out);
+    convert.setFilter(VicFilter::Bilinear);
+
+    VicSoftware software;
+
+    VicOp deinterlace = convert;
+    VicOp::Deinterlace field;
+    field.mode = VicDeinterlace::MotionAdaptive;
+    deinterlace.setDeinterlace(0, field);
+    deinterlace.setDenoise(0, 0.5f);
+
+    VicHistory history(dev);
+    HistoryFrame history_frame = { history, deinterlace, 0, nullptr, nullptr };
+
+    err |= check("NvdecDevice::run", [&] { return nvdec.run(decode); });
+    /* Without a known VIC, open() falls back to the software backend */
+    err |= check(vic.isSoftware() ? "VicDevice::run (software)" : "VicDevice::run",
+        [&] { return vic.run(convert); });
+    err |= check("VicSoftware::run", [&] { return software.run(&convert, 1); });
+    err |= check("VicHistory::apply", history_frame);
+
+    return err;
+}